@@ -0,0 +1,14 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "config.h"
+#include "worker.h"
+#include "fs_pool.h"
+
+// Serves JSON snapshots and runtime commands on 127.0.0.1:admin_port from a thread of its own.
+// Snapshots read the workers' tables and counters while they keep running; commands that touch
+// connections are handed to the owning worker. Returns -1 when admin_port is 0 or the port cannot be opened.
+int admin_start(const ServerConfig *config, Worker *workers, int worker_count, FsPool *fs_pool);
+void admin_stop();
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-worker overload detector in the style of CoDel: a worker is overloaded once a whole interval went by
+// without a single request waiting less than target, i.e. the queue never drained. Requests that waited
+// longer than target are then shed, and so is deferred work beyond the in-flight byte budget.
+// Owned by one worker; the atomics are only there so the admin endpoint can read them.
+typedef struct {
+	uint64_t target_ns;        // 0 disables admission control
+	uint64_t interval_ns;
+	uint64_t inflight_budget;  // 0 means unlimited
+	uint64_t interval_end_ns;
+	uint64_t interval_min_ns;  // lowest delay seen in the current interval, UINT64_MAX when none
+	atomic_int overloaded;
+	atomic_uint_least64_t min_delay_ns; // lowest delay of the last complete interval
+	atomic_uint_least64_t inflight_bytes;
+	atomic_uint_least64_t shed;
+} Admission;
+
+void admission_init(Admission *admission, int target_ms, int interval_ms, double inflight_budget);
+int admission_enabled(const Admission *admission);
+
+// Feed the time a request (or a job in the filesystem queue) waited before being worked on.
+void admission_sample(Admission *admission, uint64_t delay_ns, uint64_t now_ns);
+// Called on every loop iteration, so an interval without requests ends the overload.
+void admission_tick(Admission *admission, uint64_t now_ns);
+
+// New connections are only accepted while this is true: not overloaded, and room left in the budget for
+// one more request holding admission_max_hold() bytes.
+int admission_accepting(Admission *admission);
+// Most a single request may hold, half the budget, so one request alone never stops the worker from accepting.
+uint64_t admission_max_hold(const Admission *admission);
+// Whether a request that waited delay_ns should get a 503. deferred_bytes is what it would add
+// to the in-flight budget, 0 for requests answered inline.
+int admission_should_shed(Admission *admission, uint64_t delay_ns, uint64_t deferred_bytes);
+
+void admission_hold(Admission *admission, uint64_t bytes);
+void admission_release(Admission *admission, uint64_t bytes);
+
+#endif
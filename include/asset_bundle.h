@@ -0,0 +1,72 @@
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk layout written by tools/pack_bundle.c (make bundle) and mapped as is by the server.
+// All offsets are from the start of the file; integers are in host byte order.
+//
+//   AssetBundleHeader
+//   uint32_t displacements[bucket_count]
+//   AssetEntry entries[entry_count]     in perfect-hash slot order
+//   paths, then bodies and gzip variants
+#define ASSET_BUNDLE_MAGIC "WSBUNDL1"
+#define ASSET_BUNDLE_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t bucket_count;
+	uint32_t reserved;
+	uint64_t displacements_offset;
+	uint64_t entries_offset;
+	uint64_t file_size;
+} AssetBundleHeader;
+
+typedef struct {
+	uint64_t path_offset;
+	uint32_t path_length;
+	uint32_t reserved;
+	uint64_t body_offset;
+	uint64_t body_length;
+	uint64_t gzip_offset;
+	uint64_t gzip_length;    // 0 when compression did not pay off
+	char content_type[48];
+	char etag[24];           // quoted, ready to send
+	char gzip_etag[24];
+} AssetEntry;
+
+// Perfect hash over the asset paths: the bucket comes from seed 0, the slot from the bucket's displacement.
+static inline uint64_t asset_bundle_hash(const char *key, size_t len, uint64_t seed) {
+	uint64_t h = 1469598103934665603ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Maps the bundle with a single mmap(). Returns -1 and leaves the server on file/ when it is missing or invalid.
+int asset_bundle_open(const char *path);
+void asset_bundle_close();
+int asset_bundle_loaded();
+
+// name is a request path or a path below file/; a leading '/' is ignored and "/" means index.html.
+// No syscalls: one hash, one displacement and one string compare. Returns NULL when the asset is not bundled.
+const AssetEntry *asset_bundle_lookup(const char *name);
+
+// Whether the asset goes out of the mapping in a single write. Larger ones are sent with sendfile() and
+// wait for the client to drain them, so the event loop hands them to the filesystem pool.
+int asset_bundle_small(const AssetEntry *asset);
+
+// Sends the asset with its precomputed Content-Type and ETag. With the request headers at hand a gzip
+// variant is chosen for clients that accept it, and a 200 whose ETag matches If-None-Match becomes a 304.
+// Returns 0 once the response was sent, -1 when the connection broke.
+int asset_bundle_send(int client_socket, const AssetEntry *asset, long http_code, const char *request);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum {
+	CHUNK_SIZE = 0,
+	CHUNK_EXTENSION,
+	CHUNK_SIZE_LF,
+	CHUNK_DATA,
+	CHUNK_DATA_CR,
+	CHUNK_DATA_LF,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LF,
+	CHUNK_DONE,
+	CHUNK_ERROR
+} ChunkState;
+
+// Incremental decoder for a chunked request body; input may be split at any byte.
+typedef struct {
+	ChunkState state;
+	size_t remaining;  // bytes left in the current chunk
+	int size_digits;
+	int line_empty;    // current trailer line has no characters yet
+} ChunkedDecoder;
+
+typedef int (*chunk_sink)(void *ctx, const char *data, size_t len);
+
+void chunked_decoder_init(ChunkedDecoder *decoder);
+
+// Feeds len bytes and passes the decoded body data to sink. Returns the number of bytes consumed,
+// which is less than len only once the terminating chunk has been read, or -1 on malformed input
+// or when sink returns non-zero.
+ssize_t chunked_decode(ChunkedDecoder *decoder, const char *in, size_t len, chunk_sink sink, void *ctx);
+
+int chunked_decoder_done(const ChunkedDecoder *decoder);
+
+// Chunked response for handlers that do not know their length up front.
+int chunked_response_begin(int client_socket, long http_code, const char *content_type);
+int chunked_response_write(int client_socket, const char *data, size_t len);
+int chunked_response_end(int client_socket);
+
+#endif
@@ -8,6 +8,32 @@ typedef struct {
 	char root_directory[256];
 	int debug_mode;
 	char log_file[256];
+	double rate_limit_connections;
+	double rate_limit_connections_burst;
+	double rate_limit_requests;
+	double rate_limit_requests_burst;
+	double rate_limit_upload_bytes;
+	double rate_limit_upload_bytes_burst;
+	int trace_sample_rate;
+	int trace_slow_ms;
+	char trace_file[256];
+	int fs_threads;
+	int fs_queue_size;
+	int fs_queue_timeout_ms;
+	double proxy_cache_size;
+	int proxy_cache_shards;
+	char proxy_cache_spill_dir[256];
+	int proxy_cache_default_ttl;
+	int workers;
+	int pin_workers;
+	int reuseport_cpu_steering;
+	int tcp_defer_accept;
+	int tcp_fastopen;
+	int admin_port;
+	char asset_bundle[256];
+	int admission_target_ms;
+	int admission_interval_ms;
+	double admission_inflight_bytes;
 } ServerConfig;
 
 int load_config(const char *filename, ServerConfig *config);
@@ -0,0 +1,67 @@
+#ifndef FS_POOL_H
+#define FS_POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct FsPool FsPool;
+typedef struct FsJob FsJob;
+typedef struct FsCompletionQueue FsCompletionQueue;
+
+// run is called on a pool thread and may block on the filesystem.
+// done is called later on the event loop that owns the completion queue the job was submitted with.
+// timed_out is set when the job waited in the queue past its deadline and run was skipped.
+// expired, when set, is called on that loop as soon as the deadline passes, so the request can be answered
+// while the job still sits in the queue; done follows with timed_out set once a pool thread has dropped it.
+struct FsJob {
+	void (*run)(FsJob *job);
+	void (*done)(FsJob *job, int timed_out);
+	void (*expired)(FsJob *job);
+	FsCompletionQueue *completions;
+	uint64_t queued_ns;  // submitted, trace_now_ns() clock
+	uint64_t started_ns; // picked up by a pool thread, 0 if it never was; the difference is the job's queueing delay
+	uint64_t deadline_ns;
+	atomic_int state;
+	int timed_out;
+	FsJob *next;
+	FsJob *waiting_prev; // deadline list of the completion queue, only touched by its loop
+	FsJob *waiting_next;
+	int waiting;
+};
+
+typedef struct {
+	size_t queued;
+	size_t max_queued;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t rejected;
+	uint64_t timed_out;
+	uint64_t late;
+} FsPoolStats;
+
+// queue_timeout_ms bounds how long a job may wait for a thread, 0 for no limit. A running job is never
+// interrupted; one that finishes past the deadline is only counted as late.
+FsPool *fs_pool_create(int thread_count, size_t max_queue, unsigned queue_timeout_ms);
+void fs_pool_destroy(FsPool *pool);
+
+// Returns -1 without queueing the job when max_queue jobs are already waiting.
+int fs_pool_submit(FsPool *pool, FsJob *job, FsCompletionQueue *completions);
+
+// One completion queue per event loop, so each job finishes on the loop that submitted it.
+FsCompletionQueue *fs_completion_queue_create();
+void fs_completion_queue_destroy(FsCompletionQueue *completions);
+
+// Becomes readable when completions are waiting; add it to the event loop's epoll set.
+int fs_completion_queue_fd(const FsCompletionQueue *completions);
+
+// Drains the completion list and calls each job's done callback.
+void fs_completion_queue_drain(FsCompletionQueue *completions);
+
+// Expires the jobs submitted with this queue whose deadline has passed before a thread took them.
+// Call it from the owning loop on every iteration; returns the next deadline, 0 when nothing is waiting.
+uint64_t fs_completion_queue_expire(FsCompletionQueue *completions, uint64_t now_ns);
+
+void fs_pool_stats(FsPool *pool, FsPoolStats *stats);
+
+#endif
@@ -2,6 +2,10 @@
 
 static size_t write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp);
 
+// curl_global_init() is not thread-safe, so it runs once before any worker starts, and the cleanup after they stopped.
+int http_methods_init();
+void http_methods_cleanup();
+
 void http_get(const char* url, int client_socket);
 
 void http_post(const char* url, int client_socket);
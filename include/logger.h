@@ -13,4 +13,11 @@ void logger_init(LogLevel level, const char *file_path);
 void logger_close();
 void log_msg(LogLevel level, const char *format, ...);
 
+// Safe to call while other threads log.
+void logger_set_level(LogLevel level);
+LogLevel logger_get_level();
+const char *logger_level_name(LogLevel level);
+// Accepts the level names case-insensitively ("debug", "WARN"). Returns -1 for unknown names.
+int logger_parse_level(const char *name, LogLevel *level);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "memory.h"
+
+// Freshness and validators of one upstream response, filled from its headers by proxy_cache_parse_header().
+typedef struct {
+	char etag[128];
+	char last_modified[64];
+	char content_type[128];
+	long max_age;       // -1 when absent
+	long age;
+	time_t expires;     // Expires header, 0 when absent
+	int no_store;
+	int no_cache;
+} ProxyCacheMeta;
+
+typedef enum {
+	PROXY_CACHE_BYPASS = 0, // cache disabled, fetch without storing
+	PROXY_CACHE_HIT,        // http_code, body and meta->content_type hold a copy of the cached response
+	PROXY_CACHE_FETCH,      // caller must fetch and then store or abandon
+	PROXY_CACHE_REVALIDATE  // like FETCH, with the stored validators in meta for a conditional request
+} ProxyCacheResult;
+
+// budget is the total number of bytes kept in memory across all shards. Entries evicted from memory
+// are written to spill_dir when it is not empty. default_ttl (seconds) applies to responses without
+// explicit freshness information. Returns -1 when budget is 0 and the cache stays disabled.
+int proxy_cache_init(size_t budget, int shard_count, const char *spill_dir, long default_ttl);
+void proxy_cache_destroy();
+
+// Concurrent lookups of a url that is being fetched wait for that fetch instead of starting their own,
+// for at most two seconds; after that they get PROXY_CACHE_BYPASS and fetch without the cache.
+ProxyCacheResult proxy_cache_lookup(const char *url, long *http_code, struct MemoryStruct *body, ProxyCacheMeta *meta);
+void proxy_cache_parse_header(ProxyCacheMeta *meta, const char *line, size_t len);
+
+// Complete a FETCH or REVALIDATE. proxy_cache_revalidated() handles a 304 by refreshing the entry from meta
+// and copying the stored response into http_code, body and meta->content_type; it returns -1 if nothing was stored.
+void proxy_cache_store(const char *url, long http_code, const struct MemoryStruct *body, const ProxyCacheMeta *meta);
+int proxy_cache_revalidated(const char *url, ProxyCacheMeta *meta, long *http_code, struct MemoryStruct *body);
+void proxy_cache_abandon(const char *url);
+
+typedef struct {
+	size_t entries;  // in memory, including placeholders of running fetches
+	size_t fetching;
+	size_t bytes;
+	size_t budget;
+	uint64_t hits;
+	uint64_t misses;
+	int shards;
+} ProxyCacheStats;
+
+// Locks one shard at a time, so lookups on the other shards carry on meanwhile. Returns -1 when the cache is disabled.
+int proxy_cache_stats(ProxyCacheStats *stats);
+// Drops every stored response in memory and in the spill directory. Returns the number removed.
+size_t proxy_cache_flush();
+
+#endif
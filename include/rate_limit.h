@@ -0,0 +1,31 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	RL_CONNECTIONS = 0,
+	RL_REQUESTS,
+	RL_UPLOAD_BYTES,
+	RL_KIND_COUNT
+} RateLimitKind;
+
+// rate is tokens per second, burst is the bucket size. rate == 0 disables the limit.
+typedef struct {
+	double rate;
+	double burst;
+} RateLimitRule;
+
+typedef struct RateLimiter RateLimiter;
+
+// One limiter is shared by all workers, so a client gets the configured rates however its connections
+// are spread. Buckets live in open-addressed tables split into independently locked shards by address.
+// Tokens are refilled lazily from the elapsed monotonic time whenever a bucket is touched.
+RateLimiter *rate_limiter_create(const RateLimitRule rules[RL_KIND_COUNT], size_t capacity);
+void rate_limiter_destroy(RateLimiter *limiter);
+
+// Returns 1 if the client (IPv4 address in network order) may spend cost tokens, 0 if it must be rejected.
+int rate_limiter_allow(RateLimiter *limiter, uint32_t addr, RateLimitKind kind, double cost);
+
+#endif
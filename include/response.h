@@ -0,0 +1,45 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RESPONSE_HEADER_SIZE 1024
+// Bodies up to this size go out with the head in one writev(), larger ones with sendfile().
+#define RESPONSE_SMALL_BODY_SIZE 16384
+
+// Response head assembled from precomputed fragments: status line, cached Date, Server.
+// Nothing is formatted with printf, and the head goes out in the same writev() as the body.
+typedef struct {
+	char head[RESPONSE_HEADER_SIZE];
+	size_t length;
+	int overflow;
+} Response;
+
+void response_start(Response *response, long http_code);
+void response_header(Response *response, const char *name, const char *value);
+void response_content_length(Response *response, size_t length);
+void response_keep_alive(Response *response, int keep_alive);
+
+// Ends the head and sends it with body in one writev(). Returns 0 once everything was written.
+int response_send(Response *response, int client_socket, const char *body, size_t body_len);
+
+// Returned when the body could not be read and nothing was written, so the caller can still answer with an error.
+#define RESPONSE_NOT_SENT -2
+
+// Sends the head with the first size bytes of fd. Small files are read and written with the head in one
+// writev(), larger ones follow the head with sendfile() so the body is never copied to user space.
+// Returns 0 once everything was written, RESPONSE_NOT_SENT or -1 when the connection broke mid-response.
+int response_send_file(Response *response, int client_socket, int fd, off_t size);
+
+// Same for size bytes at offset of fd that are also mapped at data: small bodies go out of the mapping
+// with the head, larger ones with sendfile() from fd.
+int response_send_mapped(Response *response, int client_socket, const char *data, int fd, off_t offset, size_t size);
+
+// Writes all iovcnt buffers, resuming after short writes and waiting while the socket is full.
+int writev_all(int client_socket, struct iovec *iov, int iovcnt);
+
+const char *http_reason_phrase(long http_code);
+
+#endif
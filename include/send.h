@@ -1,11 +1,39 @@
 #include <stddef.h>
 
-void send_html(int client_socket, const char *file_path);
+// These return -1 when the connection cannot carry another request (response cut short or sent with Connection: close).
+int send_html(int client_socket, const char *file_path);
 
-void send_error_html(int client_socket, const char *file_path, long http_code);
+int send_error_html(int client_socket, const char *file_path, long http_code);
+
+void send_buffered_response(int client_socket, long http_code, const char *content_type, const char *body, size_t size);
+
+int has_local_page(long http_code);
 
 void handle_client_response(int client_socket, long http_code, struct MemoryStruct *data);
 
-void handle_file_upload(int client_socket, char *path, char *buffer, size_t bytes_read);
+// Disk side of an upload, called on a pool thread. The body goes to <path>.part, which is only renamed over
+// the target once it is durable, so readers never see a partial upload.
+typedef struct {
+	int fd; // -1 until the first write opens the part file
+	char file_path[512];
+	char part_path[520];
+} UploadFile;
+
+void upload_file_init(UploadFile *file, const char *path);
+// Opens the part file on first use, so a write of 0 bytes only checks that the upload can be stored.
+int upload_file_write(UploadFile *file, const char *data, size_t len);
+// Syncs and renames the part file into place, or removes it when that fails.
+int upload_file_commit(UploadFile *file);
+void upload_file_discard(UploadFile *file);
+
+// 100 Continue, or the final status of an upload: 201, 400, 411 or 500.
+void send_upload_status(int client_socket, long http_code, int close_connection);
+
+int handle_file_download(int client_socket, char *path);
+
+void send_rate_limited(int client_socket, int close_connection);
+
+// Loads the body of the 503 responses sent by send_service_unavailable(); the built-in text is used otherwise.
+int prepare_unavailable_page(const char *file_path);
 
-void handle_file_download(int client_socket, char *path);
\ No newline at end of file
+void send_service_unavailable(int client_socket, int close_connection);
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	TRACE_ACCEPTED = 0,
+	TRACE_WAKEUP,
+	TRACE_FIRST_BYTE,
+	TRACE_HEADERS_PARSED,
+	TRACE_HANDLER_START,
+	TRACE_UPSTREAM_CONNECT,
+	TRACE_UPSTREAM_TTFB,
+	TRACE_FIRST_BYTE_SENT,
+	TRACE_LAST_BYTE_SENT,
+	TRACE_PHASE_COUNT
+} TracePhase;
+
+typedef struct {
+	uint64_t ts[TRACE_PHASE_COUNT]; // CLOCK_MONOTONIC nanoseconds, 0 when the phase did not happen
+	int fd;
+	char method[8];
+	char path[64];
+} TraceRecord;
+
+typedef struct TraceRing TraceRing;
+
+// Keeps the last capacity requests that were either 1-in-sample_every sampled or slower than slow_ms.
+// Returns NULL when both triggers are 0, which turns every trace call into a no-op.
+TraceRing *trace_ring_create(size_t capacity, unsigned sample_every, unsigned slow_ms);
+void trace_ring_destroy(TraceRing *ring);
+
+uint64_t trace_now_ns();
+
+// A request is traced between trace_begin() and trace_end() on the calling thread, so the
+// send paths can mark phases without the record being passed through every call.
+void trace_begin(TraceRing *ring, TraceRecord *record, int fd, uint64_t accepted_ns, uint64_t wakeup_ns);
+void trace_set_request(const char *method, const char *path);
+void trace_mark(TracePhase phase);
+void trace_mark_once(TracePhase phase);
+void trace_mark_at(TracePhase phase, uint64_t ns);
+void trace_end();
+
+// Hand a request over to another thread: the loop suspends it, the worker resumes and suspends it
+// around its own marks, and the loop commits it to the ring once the worker has finished.
+TraceRecord *trace_current();
+void trace_suspend();
+void trace_resume(TraceRecord *record);
+void trace_commit(TraceRing *ring, TraceRecord *record);
+
+// Writes the ring as Chrome trace event JSON (chrome://tracing, Perfetto), with the worker id as pid.
+int trace_ring_dump(const TraceRing *ring, const char *file_path, int worker_id);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include "config.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "fs_pool.h"
+#include "admission.h"
+
+typedef enum {
+	CONN_CLOSED = 0,
+	CONN_IDLE,    // kept alive, waiting for the next request
+	CONN_ACTIVE,  // a request is being handled on the event loop
+	CONN_QUEUED   // a request was handed to the filesystem pool
+} ConnectionState;
+
+typedef struct Upload Upload;
+
+// Written only by the owning worker. The admin thread reads the atomics without locking,
+// so one row of a snapshot may mix values from before and after a request.
+typedef struct {
+	uint32_t addr;
+	uint16_t port;
+	uint64_t accepted_ns; // cleared once the first request on the connection has been traced
+	atomic_int state;
+	atomic_uint_least64_t opened_ns;
+	atomic_uint_least64_t last_active_ns;
+	atomic_uint_least64_t requests;
+	Upload *upload; // body of a PUT being received, NULL otherwise
+} ClientInfo;
+
+// Everything one event loop owns. Workers share only the filesystem pool, the proxy cache and the rate limiter.
+typedef struct {
+	int id;
+	int cpu; // -1 when the worker is not pinned
+	pthread_t thread;
+	const ServerConfig *config;
+	int listen_fd;
+	int epoll_fd;
+	struct epoll_event *events;
+	RateLimiter *limiter;
+	TraceRing *trace_ring;
+	ClientInfo *clients;
+	long max_fds;
+	atomic_long fd_limit; // one past the highest fd this worker has accepted, bounds table scans
+	FsPool *fs_pool;
+	FsCompletionQueue *completions;
+	int seen_dump;
+	Admission admission;
+	atomic_int accept_paused; // the listener is out of the epoll set while the worker is over budget
+	Upload *uploads; // every upload this worker is receiving or still has on the pool
+
+	atomic_int connections;
+	atomic_uint_least64_t accepted;
+	atomic_uint_least64_t requests;
+	atomic_uint_least64_t dropped_idle;
+	atomic_long drop_idle_ms; // set by the admin thread, consumed by the worker, 0 when nothing is pending
+} Worker;
+
+#endif
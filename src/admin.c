@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <sys/socket.h>
+#include <cjson/cJSON.h>
+#include "../include/admin.h"
+#include "../include/logger.h"
+#include "../include/proxy_cache.h"
+#include "../include/response.h"
+
+#define ADMIN_REQUEST_SIZE 2048
+#define ADMIN_RECV_TIMEOUT_S 2
+#define DEFAULT_DROP_IDLE_MS 30000
+
+static int admin_fd = -1;
+static pthread_t admin_thread;
+static Worker *admin_workers = NULL;
+static int admin_worker_count = 0;
+static FsPool *admin_fs_pool = NULL;
+static uint64_t started_ns = 0;
+
+static const char *state_names[] = { "closed", "idle", "active", "queued" };
+
+static int socket_tcp_info(int fd, struct tcp_info *info) {
+	socklen_t len = sizeof(*info);
+	memset(info, 0, sizeof(*info));
+	return getsockopt(fd, IPPROTO_TCP, TCP_INFO, info, &len);
+}
+
+// Byte counts come from the kernel so the request path needs no bookkeeping. The fd may have been
+// closed and reused since the state was read; the row then shows the newer connection's counters.
+static void add_connection(cJSON *list, int fd, ClientInfo *client, int state, uint64_t now) {
+	cJSON *item = cJSON_CreateObject();
+	char addr_text[INET_ADDRSTRLEN];
+	char peer[32];
+	struct in_addr addr = { client->addr };
+	inet_ntop(AF_INET, &addr, addr_text, sizeof(addr_text));
+	snprintf(peer, sizeof(peer), "%s:%u", addr_text, (unsigned)client->port);
+	uint64_t opened = atomic_load(&client->opened_ns);
+	uint64_t last_active = atomic_load(&client->last_active_ns);
+
+	cJSON_AddNumberToObject(item, "fd", fd);
+	cJSON_AddStringToObject(item, "peer", peer);
+	cJSON_AddStringToObject(item, "state", state_names[state]);
+	cJSON_AddNumberToObject(item, "age_ms", now > opened ? (double)((now - opened) / 1000000) : 0);
+	cJSON_AddNumberToObject(item, "idle_ms", now > last_active ? (double)((now - last_active) / 1000000) : 0);
+	cJSON_AddNumberToObject(item, "requests", (double)atomic_load(&client->requests));
+
+	struct tcp_info info;
+	if (socket_tcp_info(fd, &info) == 0) {
+		cJSON_AddNumberToObject(item, "bytes_sent", (double)info.tcpi_bytes_acked);
+		cJSON_AddNumberToObject(item, "bytes_received", (double)info.tcpi_bytes_received);
+		cJSON_AddNumberToObject(item, "unacked", info.tcpi_unacked);
+		cJSON_AddNumberToObject(item, "rtt_us", info.tcpi_rtt);
+	}
+	cJSON_AddItemToArray(list, item);
+}
+
+static cJSON *worker_snapshot(Worker *worker, int with_connections, uint64_t now) {
+	cJSON *item = cJSON_CreateObject();
+	cJSON_AddNumberToObject(item, "id", worker->id);
+	cJSON_AddNumberToObject(item, "cpu", worker->cpu);
+	cJSON_AddNumberToObject(item, "connections", atomic_load(&worker->connections));
+	cJSON_AddNumberToObject(item, "accepted", (double)atomic_load(&worker->accepted));
+	cJSON_AddNumberToObject(item, "requests", (double)atomic_load(&worker->requests));
+	cJSON_AddNumberToObject(item, "dropped_idle", (double)atomic_load(&worker->dropped_idle));
+	if (admission_enabled(&worker->admission)) {
+		cJSON *admission = cJSON_AddObjectToObject(item, "admission");
+		cJSON_AddBoolToObject(admission, "overloaded", atomic_load(&worker->admission.overloaded));
+		cJSON_AddBoolToObject(admission, "accept_paused", atomic_load(&worker->accept_paused));
+		cJSON_AddNumberToObject(admission, "min_delay_us", (double)(atomic_load(&worker->admission.min_delay_ns) / 1000));
+		cJSON_AddNumberToObject(admission, "inflight_bytes", (double)atomic_load(&worker->admission.inflight_bytes));
+		cJSON_AddNumberToObject(admission, "shed", (double)atomic_load(&worker->admission.shed));
+	}
+
+	// For a listening socket the kernel reports the accept queue in tcpi_unacked and its limit in tcpi_sacked.
+	struct tcp_info info;
+	if (socket_tcp_info(worker->listen_fd, &info) == 0) {
+		cJSON_AddNumberToObject(item, "accept_queue", info.tcpi_unacked);
+		cJSON_AddNumberToObject(item, "accept_backlog", info.tcpi_sacked);
+	}
+
+	int by_state[CONN_QUEUED + 1] = { 0 };
+	cJSON *list = with_connections ? cJSON_AddArrayToObject(item, "connection_table") : NULL;
+	long fd_limit = atomic_load(&worker->fd_limit);
+	for (long fd = 0; fd < fd_limit; fd++) {
+		ClientInfo *client = &worker->clients[fd];
+		int state = atomic_load(&client->state);
+		if (state <= CONN_CLOSED || state > CONN_QUEUED) continue;
+		by_state[state]++;
+		if (list) add_connection(list, (int)fd, client, state, now);
+	}
+	cJSON_AddNumberToObject(item, "idle", by_state[CONN_IDLE]);
+	cJSON_AddNumberToObject(item, "active", by_state[CONN_ACTIVE]);
+	cJSON_AddNumberToObject(item, "queued", by_state[CONN_QUEUED]);
+	return item;
+}
+
+static char *snapshot(int with_connections) {
+	uint64_t now = trace_now_ns();
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddNumberToObject(root, "uptime_s", (double)((now - started_ns) / 1000000000ULL));
+	cJSON_AddStringToObject(root, "log_level", logger_level_name(logger_get_level()));
+
+	cJSON *workers = cJSON_AddArrayToObject(root, "workers");
+	for (int i = 0; i < admin_worker_count; i++) {
+		cJSON_AddItemToArray(workers, worker_snapshot(&admin_workers[i], with_connections, now));
+	}
+
+	if (admin_fs_pool) {
+		FsPoolStats stats;
+		fs_pool_stats(admin_fs_pool, &stats);
+		cJSON *pool = cJSON_AddObjectToObject(root, "fs_pool");
+		cJSON_AddNumberToObject(pool, "queued", (double)stats.queued);
+		cJSON_AddNumberToObject(pool, "max_queued", (double)stats.max_queued);
+		cJSON_AddNumberToObject(pool, "submitted", (double)stats.submitted);
+		cJSON_AddNumberToObject(pool, "completed", (double)stats.completed);
+		cJSON_AddNumberToObject(pool, "rejected", (double)stats.rejected);
+		cJSON_AddNumberToObject(pool, "timed_out", (double)stats.timed_out);
+		cJSON_AddNumberToObject(pool, "late", (double)stats.late);
+	}
+
+	ProxyCacheStats cache_stats;
+	if (proxy_cache_stats(&cache_stats) == 0) {
+		cJSON *cache = cJSON_AddObjectToObject(root, "proxy_cache");
+		cJSON_AddNumberToObject(cache, "entries", (double)cache_stats.entries);
+		cJSON_AddNumberToObject(cache, "fetching", (double)cache_stats.fetching);
+		cJSON_AddNumberToObject(cache, "bytes", (double)cache_stats.bytes);
+		cJSON_AddNumberToObject(cache, "budget", (double)cache_stats.budget);
+		cJSON_AddNumberToObject(cache, "hits", (double)cache_stats.hits);
+		cJSON_AddNumberToObject(cache, "misses", (double)cache_stats.misses);
+		cJSON_AddNumberToObject(cache, "shards", cache_stats.shards);
+	}
+
+	// glibc malloc totals across all arenas.
+	struct mallinfo2 heap = mallinfo2();
+	cJSON *allocator = cJSON_AddObjectToObject(root, "allocator");
+	cJSON_AddNumberToObject(allocator, "heap_bytes", (double)heap.arena);
+	cJSON_AddNumberToObject(allocator, "mmap_bytes", (double)heap.hblkhd);
+	cJSON_AddNumberToObject(allocator, "in_use_bytes", (double)heap.uordblks);
+	cJSON_AddNumberToObject(allocator, "free_bytes", (double)heap.fordblks);
+	cJSON_AddNumberToObject(allocator, "releasable_bytes", (double)heap.keepcost);
+
+	char *json = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	return json;
+}
+
+static void send_json(int fd, long http_code, const char *json) {
+	Response response;
+	size_t len = strlen(json);
+	response_start(&response, http_code);
+	response_header(&response, "Content-Type", "application/json");
+	response_content_length(&response, len);
+	response_keep_alive(&response, 0);
+	response_send(&response, fd, json, len);
+}
+
+static void send_message(int fd, long http_code, const char *key, const char *value) {
+	char json[256];
+	snprintf(json, sizeof(json), "{\"%s\":\"%s\"}", key, value);
+	send_json(fd, http_code, json);
+}
+
+// Copies the value of name from a "a=1&b=2" query string. Returns -1 when it is absent.
+static int query_value(const char *query, const char *name, char *out, size_t size) {
+	size_t name_len = strlen(name);
+	while (query && *query) {
+		const char *end = strchr(query, '&');
+		size_t len = end ? (size_t)(end - query) : strlen(query);
+		if (len > name_len && strncmp(query, name, name_len) == 0 && query[name_len] == '=') {
+			snprintf(out, size, "%.*s", (int)(len - name_len - 1), query + name_len + 1);
+			return 0;
+		}
+		query = end ? end + 1 : NULL;
+	}
+	return -1;
+}
+
+static void handle_admin_request(int fd, const char *method, char *target) {
+	char *query = strchr(target, '?');
+	if (query) *query++ = '\0';
+	int is_get = strcmp(method, "GET") == 0;
+	int is_post = strcmp(method, "POST") == 0;
+	char value[64];
+
+	if (strcmp(target, "/stats") == 0 || strcmp(target, "/connections") == 0) {
+		if (!is_get) {
+			send_message(fd, 405, "error", "use GET");
+			return;
+		}
+		char *json = snapshot(strcmp(target, "/connections") == 0);
+		if (json) {
+			send_json(fd, 200, json);
+			cJSON_free(json);
+		} else {
+			send_message(fd, 500, "error", "out of memory");
+		}
+	} else if (strcmp(target, "/log-level") == 0) {
+		LogLevel level;
+		if (!is_post) {
+			send_message(fd, 405, "error", "use POST");
+		} else if (query_value(query, "level", value, sizeof(value)) != 0 || logger_parse_level(value, &level) != 0) {
+			send_message(fd, 400, "error", "level must be one of DEBUG, INFO, WARN, ERROR, FATAL");
+		} else {
+			logger_set_level(level);
+			log_msg(LOG_WARN, "Log level changed to %s from the admin port", logger_level_name(level));
+			send_message(fd, 200, "log_level", logger_level_name(level));
+		}
+	} else if (strcmp(target, "/cache/flush") == 0) {
+		if (!is_post) {
+			send_message(fd, 405, "error", "use POST");
+			return;
+		}
+		size_t flushed = proxy_cache_flush();
+		log_msg(LOG_INFO, "Proxy cache flushed from the admin port, %zu entries removed", flushed);
+		char json[64];
+		snprintf(json, sizeof(json), "{\"flushed\":%zu}", flushed);
+		send_json(fd, 200, json);
+	} else if (strcmp(target, "/connections/drop-idle") == 0) {
+		if (!is_post) {
+			send_message(fd, 405, "error", "use POST");
+			return;
+		}
+		long idle_ms = DEFAULT_DROP_IDLE_MS;
+		if (query_value(query, "idle_ms", value, sizeof(value)) == 0) idle_ms = strtol(value, NULL, 10);
+		if (idle_ms <= 0) {
+			send_message(fd, 400, "error", "idle_ms must be positive");
+			return;
+		}
+		// Each worker closes its own sockets on its next wakeup; the admin thread never touches them.
+		for (int i = 0; i < admin_worker_count; i++) {
+			atomic_store(&admin_workers[i].drop_idle_ms, idle_ms);
+		}
+		char json[64];
+		snprintf(json, sizeof(json), "{\"idle_ms\":%ld}", idle_ms);
+		send_json(fd, 202, json);
+	} else {
+		send_message(fd, 404, "error", "unknown endpoint");
+	}
+}
+
+static void *admin_loop(void *arg) {
+	(void)arg;
+	while (1) {
+		int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break; // listener shut down by admin_stop()
+		}
+
+		struct timeval timeout = { ADMIN_RECV_TIMEOUT_S, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		char request[ADMIN_REQUEST_SIZE];
+		ssize_t received = recv(fd, request, sizeof(request) - 1, 0);
+		if (received > 0) {
+			request[received] = '\0';
+			char method[16], target[256];
+			if (sscanf(request, "%15s %255s", method, target) == 2) {
+				handle_admin_request(fd, method, target);
+			} else {
+				send_message(fd, 400, "error", "bad request");
+			}
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+int admin_start(const ServerConfig *config, Worker *workers, int worker_count, FsPool *fs_pool) {
+	if (config->admin_port <= 0) return -1;
+
+	admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (admin_fd < 0) {
+		log_msg(LOG_ERROR, "Admin socket creation failed %d %s", errno, strerror(errno));
+		return -1;
+	}
+	int optval = 1;
+	setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	// No authentication, so the port is only reachable from the host itself.
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(config->admin_port);
+	if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0) {
+		log_msg(LOG_ERROR, "Admin port %d unavailable %d %s", config->admin_port, errno, strerror(errno));
+		close(admin_fd);
+		admin_fd = -1;
+		return -1;
+	}
+
+	admin_workers = workers;
+	admin_worker_count = worker_count;
+	admin_fs_pool = fs_pool;
+	started_ns = trace_now_ns();
+	if (pthread_create(&admin_thread, NULL, admin_loop, NULL) != 0) {
+		log_msg(LOG_ERROR, "Could not start the admin thread");
+		close(admin_fd);
+		admin_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void admin_stop() {
+	if (admin_fd < 0) return;
+	shutdown(admin_fd, SHUT_RDWR);
+	pthread_join(admin_thread, NULL);
+	close(admin_fd);
+	admin_fd = -1;
+}
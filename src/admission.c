@@ -0,0 +1,67 @@
+#include "../include/admission.h"
+
+void admission_init(Admission *admission, int target_ms, int interval_ms, double inflight_budget) {
+	admission->target_ns = target_ms > 0 ? (uint64_t)target_ms * 1000000ULL : 0;
+	admission->interval_ns = (uint64_t)(interval_ms > 0 ? interval_ms : 100) * 1000000ULL;
+	admission->inflight_budget = inflight_budget > 0 ? (uint64_t)inflight_budget : 0;
+	admission->interval_end_ns = 0;
+	admission->interval_min_ns = UINT64_MAX;
+	atomic_store(&admission->overloaded, 0);
+	atomic_store(&admission->min_delay_ns, 0);
+	atomic_store(&admission->inflight_bytes, 0);
+	atomic_store(&admission->shed, 0);
+}
+
+int admission_enabled(const Admission *admission) {
+	return admission->target_ns > 0;
+}
+
+void admission_tick(Admission *admission, uint64_t now_ns) {
+	if (!admission_enabled(admission) || now_ns < admission->interval_end_ns) return;
+
+	// An interval without samples had nothing queued, which counts as a delay of zero.
+	uint64_t min_delay = admission->interval_min_ns == UINT64_MAX ? 0 : admission->interval_min_ns;
+	atomic_store(&admission->min_delay_ns, min_delay);
+	atomic_store(&admission->overloaded, admission->interval_end_ns != 0 && min_delay >= admission->target_ns);
+	admission->interval_min_ns = UINT64_MAX;
+	admission->interval_end_ns = now_ns + admission->interval_ns;
+}
+
+void admission_sample(Admission *admission, uint64_t delay_ns, uint64_t now_ns) {
+	if (!admission_enabled(admission)) return;
+	admission_tick(admission, now_ns);
+	if (delay_ns < admission->interval_min_ns) admission->interval_min_ns = delay_ns;
+	// As in CoDel, one request that got through quickly proves the queue drains, so stop shedding right away.
+	if (delay_ns < admission->target_ns) atomic_store(&admission->overloaded, 0);
+}
+
+// Work that alone exceeds the budget still gets through when nothing else is in flight.
+static int over_budget(Admission *admission, uint64_t extra) {
+	uint64_t held = atomic_load(&admission->inflight_bytes);
+	return admission->inflight_budget && held > 0 && held + extra > admission->inflight_budget;
+}
+
+uint64_t admission_max_hold(const Admission *admission) {
+	return admission->inflight_budget ? admission->inflight_budget / 2 : UINT64_MAX;
+}
+
+int admission_accepting(Admission *admission) {
+	if (!admission_enabled(admission)) return 1;
+	return !atomic_load(&admission->overloaded) && !over_budget(admission, admission_max_hold(admission));
+}
+
+int admission_should_shed(Admission *admission, uint64_t delay_ns, uint64_t deferred_bytes) {
+	if (!admission_enabled(admission)) return 0;
+	int shed = (atomic_load(&admission->overloaded) && delay_ns >= admission->target_ns)
+		|| (deferred_bytes > 0 && over_budget(admission, deferred_bytes));
+	if (shed) atomic_fetch_add(&admission->shed, 1);
+	return shed;
+}
+
+void admission_hold(Admission *admission, uint64_t bytes) {
+	atomic_fetch_add(&admission->inflight_bytes, bytes);
+}
+
+void admission_release(Admission *admission, uint64_t bytes) {
+	atomic_fetch_sub(&admission->inflight_bytes, bytes);
+}
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/asset_bundle.h"
+#include "../include/logger.h"
+#include "../include/response.h"
+
+static int bundle_fd = -1;
+static const char *bundle_map = NULL;
+static size_t bundle_size = 0;
+static const AssetBundleHeader *bundle_header = NULL;
+static const uint32_t *bundle_displacements = NULL;
+static const AssetEntry *bundle_entries = NULL;
+
+static int range_ok(uint64_t offset, uint64_t length) {
+	return offset <= bundle_size && length <= bundle_size - offset;
+}
+
+// Checked once at startup so lookups and sends can trust every offset.
+static int validate_bundle() {
+	const AssetBundleHeader *header = bundle_header;
+	if (bundle_size < sizeof(*header) || memcmp(header->magic, ASSET_BUNDLE_MAGIC, 8) != 0) return -1;
+	if (header->version != ASSET_BUNDLE_VERSION || header->file_size != bundle_size) return -1;
+	if (header->entry_count == 0 || header->bucket_count == 0) return -1;
+	if (!range_ok(header->displacements_offset, (uint64_t)header->bucket_count * sizeof(uint32_t))) return -1;
+	if (!range_ok(header->entries_offset, (uint64_t)header->entry_count * sizeof(AssetEntry))) return -1;
+	if (header->displacements_offset % sizeof(uint32_t) != 0 || header->entries_offset % sizeof(uint64_t) != 0) return -1;
+
+	const AssetEntry *entries = (const AssetEntry *)(bundle_map + header->entries_offset);
+	for (uint32_t i = 0; i < header->entry_count; i++) {
+		const AssetEntry *entry = &entries[i];
+		if (!range_ok(entry->path_offset, entry->path_length) || !range_ok(entry->body_offset, entry->body_length)
+			|| !range_ok(entry->gzip_offset, entry->gzip_length)) return -1;
+		if (!memchr(entry->content_type, '\0', sizeof(entry->content_type)) || !memchr(entry->etag, '\0', sizeof(entry->etag))
+			|| !memchr(entry->gzip_etag, '\0', sizeof(entry->gzip_etag))) return -1;
+	}
+	return 0;
+}
+
+int asset_bundle_open(const char *path) {
+	if (!path || !path[0]) return -1;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_msg(LOG_WARN, "Asset bundle %s unavailable %d %s, serving from file/", path, errno, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		log_msg(LOG_WARN, "Asset bundle %s is empty, serving from file/", path);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_msg(LOG_WARN, "Could not map asset bundle %s %d %s", path, errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	bundle_fd = fd;
+	bundle_map = map;
+	bundle_size = (size_t)st.st_size;
+	bundle_header = (const AssetBundleHeader *)bundle_map;
+	if (validate_bundle() != 0) {
+		log_msg(LOG_WARN, "Asset bundle %s is corrupt or from another version, serving from file/", path);
+		asset_bundle_close();
+		return -1;
+	}
+	bundle_displacements = (const uint32_t *)(bundle_map + bundle_header->displacements_offset);
+	bundle_entries = (const AssetEntry *)(bundle_map + bundle_header->entries_offset);
+	return 0;
+}
+
+void asset_bundle_close() {
+	if (bundle_map) munmap((void *)bundle_map, bundle_size);
+	if (bundle_fd >= 0) close(bundle_fd);
+	bundle_fd = -1;
+	bundle_map = NULL;
+	bundle_size = 0;
+	bundle_header = NULL;
+	bundle_displacements = NULL;
+	bundle_entries = NULL;
+}
+
+int asset_bundle_loaded() {
+	return bundle_entries != NULL;
+}
+
+const AssetEntry *asset_bundle_lookup(const char *name) {
+	if (!bundle_entries) return NULL;
+
+	if (name[0] == '/') name++;
+	if (!name[0]) name = "index.html";
+	size_t len = strlen(name);
+
+	uint32_t bucket = (uint32_t)(asset_bundle_hash(name, len, 0) % bundle_header->bucket_count);
+	uint32_t slot = (uint32_t)(asset_bundle_hash(name, len, bundle_displacements[bucket]) % bundle_header->entry_count);
+	const AssetEntry *entry = &bundle_entries[slot];
+	// Paths that are not in the bundle land on some slot too, the compare rejects them.
+	if (entry->path_length != len || memcmp(bundle_map + entry->path_offset, name, len) != 0) return NULL;
+	return entry;
+}
+
+// Finds the value of a request header; the request buffer is NUL-terminated by the caller.
+static const char *header_value(const char *request, const char *name) {
+	const char *line = strstr(request, name);
+	return line ? line + strlen(name) : NULL;
+}
+
+static int header_contains(const char *value, const char *token) {
+	if (!value) return 0;
+	const char *end = strstr(value, "\r\n");
+	size_t len = end ? (size_t)(end - value) : strlen(value);
+	size_t token_len = strlen(token);
+	for (size_t i = 0; i + token_len <= len; i++) {
+		if (memcmp(value + i, token, token_len) == 0) return 1;
+	}
+	return 0;
+}
+
+int asset_bundle_small(const AssetEntry *asset) {
+	// A gzip variant is only kept when it is smaller than the body.
+	return asset->body_length <= RESPONSE_SMALL_BODY_SIZE;
+}
+
+int asset_bundle_send(int client_socket, const AssetEntry *asset, long http_code, const char *request) {
+	int gzip = asset->gzip_length > 0 && request && header_contains(header_value(request, "Accept-Encoding:"), "gzip");
+	const char *etag = gzip ? asset->gzip_etag : asset->etag;
+
+	Response response;
+	if (http_code == 200 && request && header_contains(header_value(request, "If-None-Match:"), etag)) {
+		response_start(&response, 304);
+		response_header(&response, "ETag", etag);
+		response_keep_alive(&response, 1);
+		return response_send(&response, client_socket, NULL, 0);
+	}
+
+	uint64_t offset = gzip ? asset->gzip_offset : asset->body_offset;
+	uint64_t length = gzip ? asset->gzip_length : asset->body_length;
+	response_start(&response, http_code);
+	response_header(&response, "Content-Type", asset->content_type);
+	response_header(&response, "ETag", etag);
+	if (asset->gzip_length > 0) {
+		response_header(&response, "Vary", "Accept-Encoding");
+	}
+	if (gzip) {
+		response_header(&response, "Content-Encoding", "gzip");
+	}
+	response_content_length(&response, length);
+	response_keep_alive(&response, 1);
+	return response_send_mapped(&response, client_socket, bundle_map + offset, bundle_fd, (off_t)offset, length);
+}
@@ -0,0 +1,146 @@
+#include <string.h>
+#include <sys/uio.h>
+#include "../include/chunked.h"
+#include "../include/response.h"
+
+#define MAX_CHUNK_SIZE_DIGITS 15
+
+void chunked_decoder_init(ChunkedDecoder *decoder) {
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->state = CHUNK_SIZE;
+}
+
+int chunked_decoder_done(const ChunkedDecoder *decoder) {
+	return decoder->state == CHUNK_DONE;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+ssize_t chunked_decode(ChunkedDecoder *decoder, const char *in, size_t len, chunk_sink sink, void *ctx) {
+	size_t i = 0;
+	while (i < len && decoder->state != CHUNK_DONE) {
+		char c = in[i];
+		switch (decoder->state) {
+			case CHUNK_SIZE: {
+				int digit = hex_value(c);
+				if (digit >= 0 && decoder->size_digits < MAX_CHUNK_SIZE_DIGITS) {
+					decoder->remaining = decoder->remaining * 16 + (size_t)digit;
+					decoder->size_digits++;
+				} else if (decoder->size_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+					decoder->state = CHUNK_EXTENSION;
+				} else if (decoder->size_digits > 0 && c == '\r') {
+					decoder->state = CHUNK_SIZE_LF;
+				} else {
+					decoder->state = CHUNK_ERROR;
+				}
+				i++;
+				break;
+			}
+			case CHUNK_EXTENSION:
+				if (c == '\r') decoder->state = CHUNK_SIZE_LF;
+				i++;
+				break;
+			case CHUNK_SIZE_LF:
+				if (c != '\n') {
+					decoder->state = CHUNK_ERROR;
+				} else if (decoder->remaining == 0) {
+					decoder->state = CHUNK_TRAILER;
+					decoder->line_empty = 1;
+				} else {
+					decoder->state = CHUNK_DATA;
+				}
+				i++;
+				break;
+			case CHUNK_DATA: {
+				size_t take = len - i < decoder->remaining ? len - i : decoder->remaining;
+				if (sink(ctx, in + i, take) != 0) {
+					decoder->state = CHUNK_ERROR;
+					break;
+				}
+				decoder->remaining -= take;
+				i += take;
+				if (decoder->remaining == 0) decoder->state = CHUNK_DATA_CR;
+				break;
+			}
+			case CHUNK_DATA_CR:
+				decoder->state = c == '\r' ? CHUNK_DATA_LF : CHUNK_ERROR;
+				i++;
+				break;
+			case CHUNK_DATA_LF:
+				if (c == '\n') {
+					decoder->state = CHUNK_SIZE;
+					decoder->size_digits = 0;
+				} else {
+					decoder->state = CHUNK_ERROR;
+				}
+				i++;
+				break;
+			case CHUNK_TRAILER:
+				// Trailer fields are skipped, an empty line ends the body.
+				if (c == '\r') {
+					decoder->state = CHUNK_TRAILER_LF;
+				} else {
+					decoder->line_empty = 0;
+				}
+				i++;
+				break;
+			case CHUNK_TRAILER_LF:
+				if (c != '\n') {
+					decoder->state = CHUNK_ERROR;
+				} else if (decoder->line_empty) {
+					decoder->state = CHUNK_DONE;
+				} else {
+					decoder->state = CHUNK_TRAILER;
+					decoder->line_empty = 1;
+				}
+				i++;
+				break;
+			case CHUNK_DONE:
+			case CHUNK_ERROR:
+				break;
+		}
+		if (decoder->state == CHUNK_ERROR) return -1;
+	}
+	return (ssize_t)i;
+}
+
+int chunked_response_begin(int client_socket, long http_code, const char *content_type) {
+	Response response;
+	response_start(&response, http_code);
+	response_header(&response, "Content-Type", content_type);
+	response_header(&response, "Transfer-Encoding", "chunked");
+	response_keep_alive(&response, 1);
+	return response_send(&response, client_socket, NULL, 0);
+}
+
+int chunked_response_write(int client_socket, const char *data, size_t len) {
+	if (len == 0) return 0; // an empty chunk would end the body
+
+	static const char hex_digits[] = "0123456789abcdef";
+	char size_line[20];
+	size_t start = sizeof(size_line) - 2;
+	size_line[start] = '\r';
+	size_line[start + 1] = '\n';
+	for (size_t rest = len; rest > 0; rest >>= 4) {
+		size_line[--start] = hex_digits[rest & 0xf];
+	}
+
+	struct iovec iov[3];
+	iov[0].iov_base = size_line + start;
+	iov[0].iov_len = sizeof(size_line) - start;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *)"\r\n";
+	iov[2].iov_len = 2;
+	return writev_all(client_socket, iov, 3);
+}
+
+int chunked_response_end(int client_socket) {
+	struct iovec iov = { (void *)"0\r\n\r\n", 5 };
+	return writev_all(client_socket, &iov, 1);
+}
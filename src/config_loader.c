@@ -21,12 +21,54 @@ char *read_file(const char *filename) {
 	return content;
 }
 
+static void read_number(const cJSON *json, const char *key, double *out) {
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(json, key);
+	if (cJSON_IsNumber(item)) {
+		*out = item->valuedouble;
+	}
+}
+
+static void read_flag(const cJSON *json, const char *key, int *out) {
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(json, key);
+	if (cJSON_IsBool(item)) {
+		*out = cJSON_IsTrue(item);
+	} else if (cJSON_IsNumber(item)) {
+		*out = item->valueint != 0;
+	}
+}
+
 int load_config(const char *filename, ServerConfig *config) {
 	strcpy(config->ip, "0.0.0.0");
 	config->port = 8080;
 	config->max_connections = 5;
 	strcpy(config->root_directory, "storage");
 	strcpy(config->log_file, "server.log");
+	config->rate_limit_connections = 0;
+	config->rate_limit_connections_burst = 0;
+	config->rate_limit_requests = 0;
+	config->rate_limit_requests_burst = 0;
+	config->rate_limit_upload_bytes = 0;
+	config->rate_limit_upload_bytes_burst = 0;
+	config->trace_sample_rate = 0;
+	config->trace_slow_ms = 0;
+	strcpy(config->trace_file, "trace.json");
+	config->fs_threads = 4;
+	config->fs_queue_size = 1024;
+	config->fs_queue_timeout_ms = 5000;
+	config->proxy_cache_size = 64 * 1024 * 1024;
+	config->proxy_cache_shards = 16;
+	config->proxy_cache_spill_dir[0] = '\0';
+	config->proxy_cache_default_ttl = 0;
+	config->workers = 1;
+	config->pin_workers = 0;
+	config->reuseport_cpu_steering = 0;
+	config->tcp_defer_accept = 0;
+	config->tcp_fastopen = 0;
+	config->admin_port = 0;
+	config->asset_bundle[0] = '\0';
+	config->admission_target_ms = 0;
+	config->admission_interval_ms = 100;
+	config->admission_inflight_bytes = 0;
 	char *json_string = read_file(filename);
 	if (!json_string) {
 		printf("[WARN] Config file not found, using defaults.\n");
@@ -69,6 +111,103 @@ int load_config(const char *filename, ServerConfig *config) {
 		config->log_file[sizeof(config->log_file) - 1] = '\0';
 	}
 
+	read_number(json, "rate_limit_connections", &config->rate_limit_connections);
+	read_number(json, "rate_limit_connections_burst", &config->rate_limit_connections_burst);
+	read_number(json, "rate_limit_requests", &config->rate_limit_requests);
+	read_number(json, "rate_limit_requests_burst", &config->rate_limit_requests_burst);
+	read_number(json, "rate_limit_upload_bytes", &config->rate_limit_upload_bytes);
+	read_number(json, "rate_limit_upload_bytes_burst", &config->rate_limit_upload_bytes_burst);
+
+	cJSON *sample_rate = cJSON_GetObjectItemCaseSensitive(json, "trace_sample_rate");
+	if (cJSON_IsNumber(sample_rate)) {
+		config->trace_sample_rate = sample_rate->valueint;
+	}
+
+	cJSON *slow_ms = cJSON_GetObjectItemCaseSensitive(json, "trace_slow_ms");
+	if (cJSON_IsNumber(slow_ms)) {
+		config->trace_slow_ms = slow_ms->valueint;
+	}
+
+	cJSON *trace_file = cJSON_GetObjectItemCaseSensitive(json, "trace_file");
+	if (cJSON_IsString(trace_file) && (trace_file->valuestring != NULL)) {
+		strncpy(config->trace_file, trace_file->valuestring, sizeof(config->trace_file) - 1);
+		config->trace_file[sizeof(config->trace_file) - 1] = '\0';
+	}
+
+	cJSON *fs_threads = cJSON_GetObjectItemCaseSensitive(json, "fs_threads");
+	if (cJSON_IsNumber(fs_threads)) {
+		config->fs_threads = fs_threads->valueint;
+	}
+
+	cJSON *fs_queue_size = cJSON_GetObjectItemCaseSensitive(json, "fs_queue_size");
+	if (cJSON_IsNumber(fs_queue_size)) {
+		config->fs_queue_size = fs_queue_size->valueint;
+	}
+
+	cJSON *fs_queue_timeout = cJSON_GetObjectItemCaseSensitive(json, "fs_queue_timeout_ms");
+	if (cJSON_IsNumber(fs_queue_timeout)) {
+		config->fs_queue_timeout_ms = fs_queue_timeout->valueint;
+	}
+
+	read_number(json, "proxy_cache_size", &config->proxy_cache_size);
+
+	cJSON *cache_shards = cJSON_GetObjectItemCaseSensitive(json, "proxy_cache_shards");
+	if (cJSON_IsNumber(cache_shards)) {
+		config->proxy_cache_shards = cache_shards->valueint;
+	}
+
+	cJSON *spill_dir = cJSON_GetObjectItemCaseSensitive(json, "proxy_cache_spill_dir");
+	if (cJSON_IsString(spill_dir) && (spill_dir->valuestring != NULL)) {
+		strncpy(config->proxy_cache_spill_dir, spill_dir->valuestring, sizeof(config->proxy_cache_spill_dir) - 1);
+		config->proxy_cache_spill_dir[sizeof(config->proxy_cache_spill_dir) - 1] = '\0';
+	}
+
+	cJSON *default_ttl = cJSON_GetObjectItemCaseSensitive(json, "proxy_cache_default_ttl");
+	if (cJSON_IsNumber(default_ttl)) {
+		config->proxy_cache_default_ttl = default_ttl->valueint;
+	}
+
+	cJSON *workers = cJSON_GetObjectItemCaseSensitive(json, "workers");
+	if (cJSON_IsNumber(workers)) {
+		config->workers = workers->valueint;
+	}
+
+	read_flag(json, "pin_workers", &config->pin_workers);
+	read_flag(json, "reuseport_cpu_steering", &config->reuseport_cpu_steering);
+
+	cJSON *defer_accept = cJSON_GetObjectItemCaseSensitive(json, "tcp_defer_accept");
+	if (cJSON_IsNumber(defer_accept)) {
+		config->tcp_defer_accept = defer_accept->valueint;
+	}
+
+	cJSON *fastopen = cJSON_GetObjectItemCaseSensitive(json, "tcp_fastopen");
+	if (cJSON_IsNumber(fastopen)) {
+		config->tcp_fastopen = fastopen->valueint;
+	}
+
+	cJSON *admin_port = cJSON_GetObjectItemCaseSensitive(json, "admin_port");
+	if (cJSON_IsNumber(admin_port)) {
+		config->admin_port = admin_port->valueint;
+	}
+
+	cJSON *asset_bundle = cJSON_GetObjectItemCaseSensitive(json, "asset_bundle");
+	if (cJSON_IsString(asset_bundle) && (asset_bundle->valuestring != NULL)) {
+		strncpy(config->asset_bundle, asset_bundle->valuestring, sizeof(config->asset_bundle) - 1);
+		config->asset_bundle[sizeof(config->asset_bundle) - 1] = '\0';
+	}
+
+	cJSON *admission_target = cJSON_GetObjectItemCaseSensitive(json, "admission_target_ms");
+	if (cJSON_IsNumber(admission_target)) {
+		config->admission_target_ms = admission_target->valueint;
+	}
+
+	cJSON *admission_interval = cJSON_GetObjectItemCaseSensitive(json, "admission_interval_ms");
+	if (cJSON_IsNumber(admission_interval)) {
+		config->admission_interval_ms = admission_interval->valueint;
+	}
+
+	read_number(json, "admission_inflight_bytes", &config->admission_inflight_bytes);
+
 	cJSON_Delete(json);
 	free(json_string);
 	return 0;
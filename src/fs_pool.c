@@ -0,0 +1,357 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "../include/fs_pool.h"
+#include "../include/logger.h"
+#include "../include/trace.h"
+
+typedef struct {
+	pthread_mutex_t lock;
+	FsJob **jobs;
+	size_t head;
+	size_t count;
+} FsQueue;
+
+typedef enum {
+	FS_JOB_QUEUED = 0,
+	FS_JOB_RUNNING,
+	FS_JOB_EXPIRED
+} FsJobState;
+
+struct FsCompletionQueue {
+	int event_fd;
+	pthread_mutex_t lock;
+	FsJob *head;
+	FsJob *tail;
+	// Jobs still waiting for a thread, in deadline order since every job gets the same timeout.
+	// Only the owning loop touches this list.
+	FsJob *waiting_head;
+	FsJob *waiting_tail;
+};
+
+struct FsPool {
+	int thread_count;
+	pthread_t *threads;
+	FsQueue *queues;
+	size_t max_queue;
+	uint64_t queue_timeout_ns;
+
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	atomic_size_t pending;
+	atomic_uint next_queue;
+	int stop;
+
+	atomic_size_t max_queued;
+	atomic_uint_least64_t submitted;
+	atomic_uint_least64_t completed;
+	atomic_uint_least64_t rejected;
+	atomic_uint_least64_t timed_out;
+	atomic_uint_least64_t late;
+};
+
+typedef struct {
+	FsPool *pool;
+	int index;
+} FsWorkerArg;
+
+static FsJob *queue_pop(FsQueue *queue, size_t capacity) {
+	FsJob *job = NULL;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count > 0) {
+		job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % capacity;
+		queue->count--;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+static int queue_push(FsQueue *queue, size_t capacity, FsJob *job) {
+	int pushed = 0;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count < capacity) {
+		queue->jobs[(queue->head + queue->count) % capacity] = job;
+		queue->count++;
+		pushed = 1;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return pushed;
+}
+
+// Takes from the worker's own queue first, then steals the oldest job of the other workers
+// so one slow volume cannot leave jobs waiting behind it while other threads sit idle.
+static FsJob *next_job(FsPool *pool, int index) {
+	for (int i = 0; i < pool->thread_count; i++) {
+		FsQueue *queue = &pool->queues[(index + i) % pool->thread_count];
+		FsJob *job = queue_pop(queue, pool->max_queue);
+		if (job) {
+			atomic_fetch_sub(&pool->pending, 1);
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void post_completion(FsPool *pool, FsJob *job) {
+	FsCompletionQueue *completions = job->completions;
+	job->next = NULL;
+	pthread_mutex_lock(&completions->lock);
+	if (completions->tail) {
+		completions->tail->next = job;
+	} else {
+		completions->head = job;
+	}
+	completions->tail = job;
+	pthread_mutex_unlock(&completions->lock);
+	atomic_fetch_add(&pool->completed, 1);
+
+	uint64_t one = 1;
+	if (write(completions->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		log_msg(LOG_ERROR, "Filesystem pool eventfd write failed %d", errno);
+	}
+}
+
+static void *fs_worker(void *arg) {
+	FsWorkerArg *worker = arg;
+	FsPool *pool = worker->pool;
+	int index = worker->index;
+	free(worker);
+
+	while (1) {
+		FsJob *job = next_job(pool, index);
+		if (!job) {
+			pthread_mutex_lock(&pool->idle_lock);
+			while (atomic_load(&pool->pending) == 0 && !pool->stop) {
+				pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+			}
+			int stop = pool->stop && atomic_load(&pool->pending) == 0;
+			pthread_mutex_unlock(&pool->idle_lock);
+			if (stop) break;
+			continue;
+		}
+
+		// The owning loop expires jobs at their deadline; whichever side gets here first decides.
+		int queued = FS_JOB_QUEUED;
+		if (!atomic_compare_exchange_strong(&job->state, &queued, FS_JOB_RUNNING)) {
+			job->timed_out = 1;
+			atomic_fetch_add(&pool->timed_out, 1);
+		} else {
+			job->started_ns = trace_now_ns();
+			job->timed_out = 0;
+			job->run(job);
+			if (job->deadline_ns && trace_now_ns() > job->deadline_ns) {
+				atomic_fetch_add(&pool->late, 1);
+			}
+		}
+		post_completion(pool, job);
+	}
+	return NULL;
+}
+
+FsPool *fs_pool_create(int thread_count, size_t max_queue, unsigned queue_timeout_ms) {
+	if (thread_count <= 0 || max_queue == 0) return NULL;
+
+	FsPool *pool = calloc(1, sizeof(FsPool));
+	if (!pool) return NULL;
+
+	pool->thread_count = thread_count;
+	pool->max_queue = max_queue;
+	pool->queue_timeout_ns = (uint64_t)queue_timeout_ms * 1000000ULL;
+	pthread_mutex_init(&pool->idle_lock, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+
+	pool->threads = calloc(thread_count, sizeof(pthread_t));
+	pool->queues = calloc(thread_count, sizeof(FsQueue));
+	if (!pool->threads || !pool->queues) {
+		fs_pool_destroy(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < thread_count; i++) {
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+		pool->queues[i].jobs = calloc(max_queue, sizeof(FsJob *));
+		if (!pool->queues[i].jobs) {
+			fs_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < thread_count; i++) {
+		FsWorkerArg *arg = malloc(sizeof(FsWorkerArg));
+		if (arg) {
+			arg->pool = pool;
+			arg->index = i;
+		}
+		if (!arg || pthread_create(&pool->threads[i], NULL, fs_worker, arg) != 0) {
+			free(arg);
+			log_msg(LOG_ERROR, "Could not start filesystem worker %d", i);
+			pool->thread_count = i;
+			fs_pool_destroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+void fs_pool_destroy(FsPool *pool) {
+	if (!pool) return;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	if (pool->threads) {
+		for (int i = 0; i < pool->thread_count; i++) {
+			pthread_join(pool->threads[i], NULL);
+		}
+	}
+
+	if (pool->queues) {
+		for (int i = 0; i < pool->thread_count; i++) {
+			free(pool->queues[i].jobs);
+		}
+	}
+	free(pool->queues);
+	free(pool->threads);
+	free(pool);
+}
+
+int fs_pool_submit(FsPool *pool, FsJob *job, FsCompletionQueue *completions) {
+	// Set before anything can fail, so a rejected job never carries stale timestamps.
+	job->queued_ns = trace_now_ns();
+	job->started_ns = 0;
+	size_t queued = atomic_fetch_add(&pool->pending, 1) + 1;
+	if (queued > pool->max_queue) {
+		atomic_fetch_sub(&pool->pending, 1);
+		atomic_fetch_add(&pool->rejected, 1);
+		return -1;
+	}
+
+	job->completions = completions;
+	job->timed_out = 0;
+	job->waiting = 0;
+	atomic_store(&job->state, FS_JOB_QUEUED);
+	job->deadline_ns = pool->queue_timeout_ns ? job->queued_ns + pool->queue_timeout_ns : 0;
+	unsigned start = atomic_fetch_add(&pool->next_queue, 1);
+	int pushed = 0;
+	for (int i = 0; i < pool->thread_count && !pushed; i++) {
+		pushed = queue_push(&pool->queues[(start + i) % pool->thread_count], pool->max_queue, job);
+	}
+	if (!pushed) {
+		atomic_fetch_sub(&pool->pending, 1);
+		atomic_fetch_add(&pool->rejected, 1);
+		return -1;
+	}
+
+	// Linked after the push: a thread may already run the job, but its completion is only drained on this loop.
+	if (job->deadline_ns) {
+		job->waiting_prev = completions->waiting_tail;
+		job->waiting_next = NULL;
+		if (completions->waiting_tail) {
+			completions->waiting_tail->waiting_next = job;
+		} else {
+			completions->waiting_head = job;
+		}
+		completions->waiting_tail = job;
+		job->waiting = 1;
+	}
+
+	size_t max = atomic_load(&pool->max_queued);
+	while (queued > max && !atomic_compare_exchange_weak(&pool->max_queued, &max, queued)) {
+	}
+	atomic_fetch_add(&pool->submitted, 1);
+
+	pthread_mutex_lock(&pool->idle_lock);
+	pthread_cond_signal(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+	return 0;
+}
+
+FsCompletionQueue *fs_completion_queue_create() {
+	FsCompletionQueue *completions = calloc(1, sizeof(FsCompletionQueue));
+	if (!completions) return NULL;
+
+	completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (completions->event_fd < 0) {
+		free(completions);
+		return NULL;
+	}
+	pthread_mutex_init(&completions->lock, NULL);
+	return completions;
+}
+
+// The pool must be destroyed first so no job can still be posted here.
+void fs_completion_queue_destroy(FsCompletionQueue *completions) {
+	if (!completions) return;
+	fs_completion_queue_drain(completions);
+	close(completions->event_fd);
+	pthread_mutex_destroy(&completions->lock);
+	free(completions);
+}
+
+int fs_completion_queue_fd(const FsCompletionQueue *completions) {
+	return completions->event_fd;
+}
+
+static void unlink_waiting(FsCompletionQueue *completions, FsJob *job) {
+	if (!job->waiting) return;
+	if (job->waiting_prev) {
+		job->waiting_prev->waiting_next = job->waiting_next;
+	} else {
+		completions->waiting_head = job->waiting_next;
+	}
+	if (job->waiting_next) {
+		job->waiting_next->waiting_prev = job->waiting_prev;
+	} else {
+		completions->waiting_tail = job->waiting_prev;
+	}
+	job->waiting = 0;
+}
+
+uint64_t fs_completion_queue_expire(FsCompletionQueue *completions, uint64_t now_ns) {
+	FsJob *job;
+	while ((job = completions->waiting_head) != NULL && job->deadline_ns <= now_ns) {
+		unlink_waiting(completions, job);
+		// A job a thread has already started runs to completion and is only counted as late.
+		int queued = FS_JOB_QUEUED;
+		if (atomic_compare_exchange_strong(&job->state, &queued, FS_JOB_EXPIRED) && job->expired) {
+			job->expired(job);
+		}
+	}
+	return job ? job->deadline_ns : 0;
+}
+
+void fs_completion_queue_drain(FsCompletionQueue *completions) {
+	uint64_t count;
+	if (read(completions->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		log_msg(LOG_ERROR, "Filesystem pool eventfd read failed %d", errno);
+	}
+
+	pthread_mutex_lock(&completions->lock);
+	FsJob *job = completions->head;
+	completions->head = NULL;
+	completions->tail = NULL;
+	pthread_mutex_unlock(&completions->lock);
+
+	while (job) {
+		FsJob *next = job->next;
+		unlink_waiting(completions, job);
+		job->done(job, job->timed_out);
+		job = next;
+	}
+}
+
+void fs_pool_stats(FsPool *pool, FsPoolStats *stats) {
+	stats->queued = atomic_load(&pool->pending);
+	stats->max_queued = atomic_load(&pool->max_queued);
+	stats->submitted = atomic_load(&pool->submitted);
+	stats->completed = atomic_load(&pool->completed);
+	stats->rejected = atomic_load(&pool->rejected);
+	stats->timed_out = atomic_load(&pool->timed_out);
+	stats->late = atomic_load(&pool->late);
+}
@@ -5,8 +5,17 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include "../include/memory.h"
 #include "../include/send.h"
+#include "../include/trace.h"
+#include "../include/proxy_cache.h"
+#include "../include/chunked.h"
+#include "../include/logger.h"
+
+// Proxy requests run on the event loops, so a hung upstream must not hold one for long.
+#define UPSTREAM_CONNECT_TIMEOUT_MS 3000
+#define UPSTREAM_TIMEOUT_MS 10000
 
 static size_t write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp) {
 	size_t realsize = size * nmemb;
@@ -26,45 +35,171 @@ static size_t write_memory_callback(void *contents, size_t size, size_t nmemb, v
 	return realsize;
 }
 
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+	proxy_cache_parse_header((ProxyCacheMeta *)userdata, buffer, size * nitems);
+	return size * nitems;
+}
+
+// Statuses with a local page replace the upstream body, everything else is passed through.
+static void relay_response(int client_socket, long http_code, const char *content_type, struct MemoryStruct *chunk) {
+	printf("HTTP Code: %ld\n", http_code);
+	printf("Size: %lu bytes\n", (unsigned long)chunk->size);
+	if (has_local_page(http_code)) {
+		handle_client_response(client_socket, http_code, chunk);
+	} else {
+		send_buffered_response(client_socket, http_code, content_type[0] ? content_type : "application/octet-stream",
+			chunk->memory, chunk->size);
+	}
+}
+
+typedef struct {
+	CURL *curl_handle;
+	int client_socket;
+	struct MemoryStruct *chunk;
+	const ProxyCacheMeta *meta;
+	int keep_body;      // the body is needed for the cache
+	int streaming;      // a chunked response to the client has been started
+	int client_failed;
+} ProxyRelay;
+
+// Passes upstream data on to the client as chunks as soon as it arrives instead of after the transfer.
+static size_t relay_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+	ProxyRelay *relay = (ProxyRelay *)userp;
+	size_t realsize = size * nmemb;
+
+	if (!relay->streaming && !relay->client_failed && relay->chunk->size == 0) {
+		long http_code = 0;
+		curl_easy_getinfo(relay->curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+		if (!has_local_page(http_code)) {
+			const char *content_type = relay->meta->content_type[0] ? relay->meta->content_type : "application/octet-stream";
+			relay->streaming = chunked_response_begin(relay->client_socket, http_code, content_type) == 0;
+			relay->client_failed = !relay->streaming;
+		}
+	}
+	if (relay->streaming && !relay->client_failed) {
+		relay->client_failed = chunked_response_write(relay->client_socket, contents, realsize) != 0;
+	}
+	if (relay->streaming && !relay->keep_body) {
+		return realsize;
+	}
+	return write_memory_callback(contents, size, nmemb, relay->chunk);
+}
+
+static CURL *upstream_handle() {
+	CURL *curl_handle = curl_easy_init();
+	if (curl_handle) {
+		curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, (long)UPSTREAM_CONNECT_TIMEOUT_MS);
+		curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, (long)UPSTREAM_TIMEOUT_MS);
+		// Timeouts must not be delivered as signals to whichever worker thread happens to run.
+		curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+	}
+	return curl_handle;
+}
+
+int http_methods_init() {
+	CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
+	if (res != CURLE_OK) {
+		fprintf(stderr, "curl_global_init() failed: %s\n", curl_easy_strerror(res));
+		return -1;
+	}
+	return 0;
+}
+
+void http_methods_cleanup() {
+	curl_global_cleanup();
+}
+
 void http_get(const char* url, int client_socket) {
 	CURL *curl_handle;
 	CURLcode res; // result code
 	struct MemoryStruct chunk;
 	long http_code = 0;
+	ProxyCacheMeta cached_meta;
+
+	ProxyCacheResult cached = proxy_cache_lookup(url, &http_code, &chunk, &cached_meta);
+	if (cached == PROXY_CACHE_HIT) {
+		log_msg(LOG_DEBUG, "Cache hit: %s", url);
+		relay_response(client_socket, http_code, cached_meta.content_type, &chunk);
+		free(chunk.memory);
+		return;
+	}
 
 	chunk.memory = malloc(1);
 	chunk.memory[0] = '\0';
 	chunk.size = 0;
 
-	curl_global_init(CURL_GLOBAL_DEFAULT);
-	curl_handle = curl_easy_init();
+	// Freshness and validators of the new response, stored with it.
+	ProxyCacheMeta response_meta;
+	memset(&response_meta, 0, sizeof(response_meta));
+	response_meta.max_age = -1;
+	struct curl_slist *conditional = NULL;
+
+	curl_handle = upstream_handle();
 	if (curl_handle) {
+		ProxyRelay relay = { curl_handle, client_socket, &chunk, &response_meta, cached != PROXY_CACHE_BYPASS, 0, 0 };
 		curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_callback);
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+		curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, relay_callback);
+		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&relay);
+		curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_callback);
+		curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&response_meta);
 
+		if (cached == PROXY_CACHE_REVALIDATE) {
+			char header[256];
+			if (cached_meta.etag[0]) {
+				snprintf(header, sizeof(header), "If-None-Match: %s", cached_meta.etag);
+				conditional = curl_slist_append(conditional, header);
+			}
+			if (cached_meta.last_modified[0]) {
+				snprintf(header, sizeof(header), "If-Modified-Since: %s", cached_meta.last_modified);
+				conditional = curl_slist_append(conditional, header);
+			}
+			curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, conditional);
+		}
+
+		uint64_t upstream_start = trace_now_ns();
 		res = curl_easy_perform(curl_handle);
 		if (res != CURLE_OK) {
 			fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+			proxy_cache_abandon(url);
+			if (relay.streaming) {
+				// Without the terminating chunk the client sees the response as truncated.
+				shutdown(client_socket, SHUT_RDWR);
+			}
 		} else {
 			curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-			handle_client_response(client_socket, http_code, &chunk);
-			send(client_socket, chunk.memory, chunk.size, 0);
-			printf("HTTP Code: %ld\n", http_code);
-			printf("Size: %lu bytes\n", (unsigned long)chunk.size);
-
-			if (chunk.size > 0) {
-				printf("Data: %s\n", chunk.memory);
-				send(client_socket, chunk.memory, chunk.size, 0);	
+			curl_off_t connect_us = 0, ttfb_us = 0;
+			curl_easy_getinfo(curl_handle, CURLINFO_CONNECT_TIME_T, &connect_us);
+			curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+			trace_mark_at(TRACE_UPSTREAM_CONNECT, upstream_start + (uint64_t)connect_us * 1000ULL);
+			trace_mark_at(TRACE_UPSTREAM_TTFB, upstream_start + (uint64_t)ttfb_us * 1000ULL);
+
+			if (cached == PROXY_CACHE_REVALIDATE && http_code == 304) {
+				log_msg(LOG_DEBUG, "Cache revalidated: %s", url);
+				free(chunk.memory);
+				chunk.memory = NULL;
+				chunk.size = 0;
+				if (proxy_cache_revalidated(url, &response_meta, &http_code, &chunk) != 0 || !chunk.memory) {
+					chunk.memory = calloc(1, 1);
+					chunk.size = 0;
+				}
 			} else {
-				printf("Data: [EMPTY BODY]\n");
+				proxy_cache_store(url, http_code, &chunk, &response_meta);
+			}
+
+			if (relay.streaming) {
+				if (!relay.client_failed) chunked_response_end(client_socket);
+				log_msg(LOG_DEBUG, "HTTP Code: %ld (streamed)", http_code);
+			} else {
+				relay_response(client_socket, http_code, response_meta.content_type, &chunk);
 			}
 		}
 
+		curl_slist_free_all(conditional);
 		curl_easy_cleanup(curl_handle);
-		free(chunk.memory);
+	} else {
+		proxy_cache_abandon(url);
 	}
-	curl_global_cleanup();
+	free(chunk.memory);
 }
 
 void http_post(const char* url, int client_socket) {
@@ -73,8 +208,7 @@ void http_post(const char* url, int client_socket) {
 	char *post_data = "field1=value1&field2=value2";
 	int http_code = 0;
 
-	curl_global_init(CURL_GLOBAL_DEFAULT);
-	curl_handle = curl_easy_init();
+	curl_handle = upstream_handle();
 	if (curl_handle) {
 		curl_easy_setopt(curl_handle, CURLOPT_URL, url);
 		curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_data);
@@ -88,21 +222,10 @@ void http_post(const char* url, int client_socket) {
 		"Request processed via CURL.\nTarget URL: %s\nResponse Code: %d\n", 
 				url, http_code);
 
-			char header[1024];
-			snprintf(header, sizeof(header),
-		"HTTP/1.1 200 OK\r\n"
-				"Content-Type: text/plain\r\n"
-				"Content-Length: %d\r\n"
-				"Connection: keep-alive\r\n"
-				"\r\n", 
-				body_len);
-
-			send(client_socket, header, strlen(header), 0);
-			send(client_socket, body, body_len, 0);
+			send_buffered_response(client_socket, 200, "text/plain", body, body_len);
 		}
 		curl_easy_cleanup(curl_handle);
 	}
-	curl_global_cleanup();
 }
 
 void http_delete(const char* url, int client_socket) {
@@ -110,8 +233,7 @@ void http_delete(const char* url, int client_socket) {
 	CURLcode res;
 	long http_code = 0;
 
-	curl_global_init(CURL_GLOBAL_DEFAULT);
-	curl_handle = curl_easy_init();
+	curl_handle = upstream_handle();
 	if (curl_handle) {
 		curl_easy_setopt(curl_handle, CURLOPT_URL, url);
 		curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
@@ -123,19 +245,10 @@ void http_delete(const char* url, int client_socket) {
 			char body[1024];
 			int body_len = snprintf(body, sizeof(body),
 		"Request processed via CURL.\nTarget URL: %s\nResponse Code: %ld\n", url, http_code);
-			char header[1024];
-			snprintf(header, sizeof(header),
-				"HTTP/1.1 200 OK\r\n"
-				"Content-Type: text/plain\r\n"
-				"Content-Length: %d\r\n"
-				"Connection: keep-alive\r\n"
-				"\r\n", body_len);
-			send(client_socket, header, strlen(header), 0);
-			send(client_socket, body, body_len, 0);
+			send_buffered_response(client_socket, 200, "text/plain", body, body_len);
 			curl_easy_cleanup(curl_handle);
 		}
 	}
-	curl_global_cleanup();
 }
 
 static size_t read_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
@@ -171,13 +284,7 @@ void http_put(const char* url, const char* file_path, int client_socket) {
 		return;
 	}
 
-	res = curl_global_init(CURL_GLOBAL_ALL);
-	if (res != CURLE_OK) {
-		printf("curl_global_init() failed: %s\n", curl_easy_strerror(res));
-		fclose(hd_src);
-		return;
-	}
-	curl_handle = curl_easy_init();
+	curl_handle = upstream_handle();
 	if (curl_handle) {
 		curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, read_callback);
 		curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1L);
@@ -194,19 +301,10 @@ void http_put(const char* url, const char* file_path, int client_socket) {
 			char body[1024];
 			int body_len = snprintf(body, sizeof(body),
 		"Request processed via CURL.\nTarget URL: %s\nResponse Code: %d\n", url, http_code);
-			char header[1024];
-			snprintf(header, sizeof(header),
-				"HTTP/1.1 200 OK\r\n"
-				"Content-Type: text/plain\r\n"
-				"Content-Length: %d\r\n"
-				"Connection: keep-alive\r\n"
-				"\r\n", body_len);
-			send(client_socket, header, strlen(header), 0);
-			send(client_socket, body, body_len, 0);
+			send_buffered_response(client_socket, 200, "text/plain", body, body_len);
 			curl_easy_cleanup(curl_handle);
 		}
 		curl_easy_cleanup(curl_handle);
 	}
 	fclose(hd_src);
-	curl_global_cleanup();
 }
\ No newline at end of file
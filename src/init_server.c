@@ -1,148 +1,1203 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include "../include/send.h"
 #include "../include/http_methods.h"
 #include "../include/config.h"
 #include "../include/logger.h"
+#include "../include/rate_limit.h"
+#include "../include/trace.h"
+#include "../include/fs_pool.h"
+#include "../include/proxy_cache.h"
+#include "../include/worker.h"
+#include "../include/admin.h"
+#include "../include/asset_bundle.h"
+#include "../include/chunked.h"
 
+#define RATE_LIMIT_TABLE_SIZE 4096
+#define TRACE_RING_SIZE 4096
+#define ACCEPT_BATCH 256
+#define EPOLL_TIMEOUT_MS 1000
+#define REQUEST_CMSG_SIZE 64
+#define CLIENT_TABLE_MAX 65536
+#define UPLOAD_BATCH (64 * 1024)
+#define UPLOAD_RECV_SIZE 16384
+#define UPLOAD_IDLE_MS 30000
 
-int setup_server() {
+static volatile sig_atomic_t dump_generation = 0;
 
-	ServerConfig config;
-	load_config("config.json", &config);
+static void handle_dump_signal(int signo) {
+	(void)signo;
+	dump_generation++;
+}
 
-	LogLevel log_level = config.debug_mode ? LOG_DEBUG : LOG_INFO;
-	logger_init(log_level, config.log_file);
+static void track_client(Worker *worker, int client_fd, const struct sockaddr_in *addr) {
+	if (client_fd >= worker->max_fds) return;
+	ClientInfo *client = &worker->clients[client_fd];
+	uint64_t now = trace_now_ns();
+	client->addr = addr->sin_addr.s_addr;
+	client->port = ntohs(addr->sin_port);
+	client->accepted_ns = worker->trace_ring ? now : 0;
+	atomic_store(&client->opened_ns, now);
+	atomic_store(&client->last_active_ns, now);
+	atomic_store(&client->requests, 0);
+	atomic_store(&client->state, CONN_IDLE);
+	client->upload = NULL;
+	if (client_fd >= atomic_load(&worker->fd_limit)) atomic_store(&worker->fd_limit, client_fd + 1);
+	atomic_fetch_add(&worker->connections, 1);
+}
 
-	log_msg(LOG_INFO, "Server configuration loaded: IP=%s, Port=%d, Max Connections=%d, Root Dir=%s, Log File=%s",
-		config.ip, config.port, config.max_connections, config.root_directory, config.log_file);
-	
-	log_msg(LOG_DEBUG, "Debug mode is ON. Detailed logs enabled.");
+static void set_client_state(Worker *worker, int client_fd, ConnectionState state) {
+	if (client_fd >= worker->max_fds) return;
+	ClientInfo *client = &worker->clients[client_fd];
+	atomic_store(&client->last_active_ns, trace_now_ns());
+	atomic_store(&client->state, state);
+}
+
+static void close_client(Worker *worker, int client_fd) {
+	if (client_fd < worker->max_fds && atomic_exchange(&worker->clients[client_fd].state, CONN_CLOSED) != CONN_CLOSED) {
+		atomic_fetch_sub(&worker->connections, 1);
+	}
+	close(client_fd);
+}
+
+static long request_content_length(const char *buffer) {
+	const char *len_str = strstr(buffer, "Content-Length: ");
+	return len_str ? strtol(len_str + 16, NULL, 10) : 0;
+}
+
+// A body still on the wire would be parsed as the next request if the connection were kept.
+static int request_has_body(const char *buffer) {
+	return request_content_length(buffer) > 0 || strstr(buffer, "Transfer-Encoding: chunked") != NULL;
+}
+
+typedef enum {
+	FILE_ROUTE_INDEX,
+	FILE_ROUTE_ASSET,
+	FILE_ROUTE_DOWNLOAD,
+	FILE_ROUTE_NOT_ALLOWED,
+	FILE_ROUTE_NOT_FOUND
+} FileRoute;
+
+typedef struct {
+	FsJob base;
+	Worker *worker;
+	FileRoute route;
+	int client_fd;
+	int keep_alive;
+	uint64_t held_bytes; // charged to the worker's in-flight budget until the job is freed
+	TraceRecord *trace; // NULL when the request is not traced, else points at trace_storage
+	TraceRecord trace_storage;
+	char path[256];
+	const AssetEntry *asset; // FILE_ROUTE_ASSET only, with the request headers it is negotiated against
+	char request[1024];
+} FileJob;
+
+// Returns 0 when the connection must be closed afterwards.
+static int run_file_route(FileRoute route, int client_fd, char *path, const AssetEntry *asset, const char *request) {
+	switch (route) {
+		case FILE_ROUTE_INDEX: return send_html(client_fd, "file/index.html") == 0;
+		case FILE_ROUTE_ASSET: return asset_bundle_send(client_fd, asset, 200, request) == 0;
+		case FILE_ROUTE_DOWNLOAD: return handle_file_download(client_fd, path) == 0;
+		case FILE_ROUTE_NOT_ALLOWED: return send_error_html(client_fd, "file/405.html", 405) == 0;
+		case FILE_ROUTE_NOT_FOUND: return send_error_html(client_fd, "file/404.html", 404) == 0;
+	}
+	return 1;
+}
+
+static void run_file_job(FsJob *job) {
+	FileJob *file_job = (FileJob *)job;
+	if (file_job->trace) trace_resume(file_job->trace);
+	if (!run_file_route(file_job->route, file_job->client_fd, file_job->path, file_job->asset, file_job->request)) {
+		file_job->keep_alive = 0;
+	}
+	trace_mark(TRACE_LAST_BYTE_SENT);
+	trace_suspend();
+}
+
+// Time spent in the pool queue counts as queueing delay like time spent before the loop read the request.
+static void sample_queue_wait(Worker *worker, const FsJob *job, uint64_t until_ns) {
+	uint64_t waited = until_ns > job->queued_ns ? until_ns - job->queued_ns : 0;
+	admission_sample(&worker->admission, waited, trace_now_ns());
+}
+
+// Puts a connection that was out of the epoll set back in, or closes it.
+static void resume_client(Worker *worker, int client_fd, int keep_alive) {
+	if (!keep_alive) {
+		close_client(worker, client_fd);
+		return;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = client_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+		close_client(worker, client_fd);
+	} else {
+		set_client_state(worker, client_fd, CONN_IDLE);
+	}
+}
+
+// Called on the loop when the job's deadline passes before a thread took it, so the client is answered
+// now rather than whenever a thread gets to drop the job.
+static void expire_file_job(FsJob *job) {
+	FileJob *file_job = (FileJob *)job;
+	Worker *worker = file_job->worker;
+	sample_queue_wait(worker, job, trace_now_ns());
+	log_msg(LOG_WARN, "Filesystem job for fd %d expired in the queue", file_job->client_fd);
+	send_service_unavailable(file_job->client_fd, !file_job->keep_alive);
+	trace_commit(worker->trace_ring, file_job->trace);
+	resume_client(worker, file_job->client_fd, file_job->keep_alive);
+}
+
+static void finish_file_job(FsJob *job, int timed_out) {
+	FileJob *file_job = (FileJob *)job;
+	Worker *worker = file_job->worker;
+	admission_release(&worker->admission, file_job->held_bytes);
+
+	// An expired job was answered at its deadline, and its connection may carry another request by now.
+	if (!timed_out) {
+		// A job the full queue turned away never waited, and sampling it as a short wait would end an overload.
+		if (job->started_ns) sample_queue_wait(worker, job, job->started_ns);
+		trace_commit(worker->trace_ring, file_job->trace);
+		resume_client(worker, file_job->client_fd, file_job->keep_alive);
+	}
+	free(file_job);
+}
+
+// The bundled page a route answers with, NULL when it reads storage or the page is not bundled.
+static const AssetEntry *file_route_page(FileRoute route) {
+	switch (route) {
+		case FILE_ROUTE_INDEX: return asset_bundle_lookup("index.html");
+		case FILE_ROUTE_NOT_ALLOWED: return asset_bundle_lookup("405.html");
+		case FILE_ROUTE_NOT_FOUND: return asset_bundle_lookup("404.html");
+		default: return NULL;
+	}
+}
+
+// Hands a disk-touching request to the filesystem pool so the event loop never blocks on storage,
+// nor on a client draining a body too large to be sent in one write.
+// The connection leaves the epoll set until the job completes, so nothing else reads from it meanwhile.
+// Returns 1 when the request was deferred, 0 when it was answered inline and *keep_alive is up to date.
+static int dispatch_file_route(Worker *worker, FileRoute route, int client_fd, char *path, const AssetEntry *asset,
+	char *buffer, int *keep_alive) {
+	// Small pages from the mapped asset bundle go out in a single write and never wait on storage.
+	const AssetEntry *page = route == FILE_ROUTE_ASSET ? asset : file_route_page(route);
+	if (!worker->fs_pool || (page && asset_bundle_small(page))) {
+		if (!run_file_route(route, client_fd, path, asset, buffer)) *keep_alive = 0;
+		return 0;
+	}
+
+	uint64_t held_bytes = sizeof(FileJob);
+	if (admission_should_shed(&worker->admission, 0, held_bytes)) {
+		log_msg(LOG_DEBUG, "In-flight budget exceeded, shedding request on fd %d", client_fd);
+		if (request_has_body(buffer)) *keep_alive = 0;
+		send_service_unavailable(client_fd, !*keep_alive);
+		return 0;
+	}
+
+	FileJob *job = malloc(sizeof(FileJob));
+	if (!job) {
+		send_service_unavailable(client_fd, !*keep_alive);
+		return 0;
+	}
+	job->base.run = run_file_job;
+	job->base.done = finish_file_job;
+	job->base.expired = expire_file_job;
+	job->worker = worker;
+	job->route = route;
+	job->client_fd = client_fd;
+	job->keep_alive = *keep_alive;
+	job->held_bytes = held_bytes;
+	job->trace = NULL;
+	snprintf(job->path, sizeof(job->path), "%s", path);
+	job->asset = asset;
+	snprintf(job->request, sizeof(job->request), "%s", route == FILE_ROUTE_ASSET ? buffer : "");
+
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+	set_client_state(worker, client_fd, CONN_QUEUED);
+	TraceRecord *trace = trace_current();
+	if (trace) {
+		job->trace_storage = *trace;
+		job->trace = &job->trace_storage;
+	}
+	trace_suspend();
+
+	admission_hold(&worker->admission, held_bytes);
+	if (fs_pool_submit(worker->fs_pool, &job->base, worker->completions) != 0) {
+		log_msg(LOG_WARN, "Filesystem queue full, rejecting request on fd %d", client_fd);
+		send_service_unavailable(client_fd, !job->keep_alive);
+		finish_file_job(&job->base, 0);
+	}
+	return 1;
+}
+
+typedef enum {
+	UPLOAD_WRITE,   // appends the batch, opening the part file first
+	UPLOAD_COMMIT,  // appends the last batch, syncs and renames
+	UPLOAD_DISCARD  // closes and removes the part file
+} UploadOp;
+
+// A PUT body is received on the event loop and only the disk work goes to the pool, one job at a time so
+// the batches land in order. The loop fills one buffer while the pool writes the other and stops reading
+// once both are taken: a slow disk slows the client down instead of growing memory, and a slow client
+// never holds a pool thread.
+struct Upload {
+	FsJob base;
+	Worker *worker;
+	int client_fd;         // -1 once the request has been answered or the client is gone
+	uint32_t peer;
+	int keep_alive;
+	int chunked;
+	ChunkedDecoder decoder;
+	uint64_t remaining;    // Content-Length bytes not received yet
+	int refused;           // status a chunked upload was refused with by the rate limiter
+	int body_done;
+	int awaiting_continue; // the client sent Expect: 100-continue and waits for the part file to open
+	int reading;           // the connection is in the epoll set
+	int in_flight;         // base is with the pool
+	UploadOp op;
+	int op_failed;         // set by the pool thread
+	UploadFile file;
+	size_t batch;          // capacity of each buffer used, at most UPLOAD_BATCH
+	char *filling;         // receives the body on the loop
+	size_t filled;         // charged to the in-flight budget, like writing_len
+	char *writing;         // being written by the pool
+	size_t writing_len;
+	uint64_t last_progress_ns;
+	TraceRecord *trace;
+	TraceRecord trace_storage;
+	Upload *prev;
+	Upload *next;
+	char buffers[2][UPLOAD_BATCH];
+};
+
+static void finish_upload_job(FsJob *job, int timed_out);
+
+static void run_upload_job(FsJob *job) {
+	Upload *upload = (Upload *)job;
+	int saved = 1;
+	switch (upload->op) {
+		case UPLOAD_WRITE:
+			saved = upload_file_write(&upload->file, upload->writing, upload->writing_len) == 0;
+			break;
+		case UPLOAD_COMMIT:
+			saved = upload_file_write(&upload->file, upload->writing, upload->writing_len) == 0
+				&& upload_file_commit(&upload->file) == 0;
+			break;
+		case UPLOAD_DISCARD:
+			upload_file_discard(&upload->file);
+			break;
+	}
+	upload->op_failed = !saved;
+}
+
+static void free_upload(Upload *upload) {
+	Worker *worker = upload->worker;
+	if (upload->prev) {
+		upload->prev->next = upload->next;
+	} else {
+		worker->uploads = upload->next;
+	}
+	if (upload->next) upload->next->prev = upload->prev;
+	admission_release(&worker->admission, upload->filled);
+	free(upload);
+}
+
+// Hands the next disk operation to the pool, or runs it right here without one. The upload may be freed
+// by the time this returns 0; -1 means the queue was full and nothing changed hands.
+static int submit_upload(Upload *upload, UploadOp op) {
+	Worker *worker = upload->worker;
+	upload->op = op;
+	upload->op_failed = 0;
+	if (op != UPLOAD_DISCARD) {
+		char *full = upload->filling;
+		upload->filling = upload->writing;
+		upload->writing = full;
+		upload->writing_len = upload->filled;
+		upload->filled = 0;
+	}
+	upload->in_flight = 1;
+
+	if (!worker->fs_pool) {
+		upload->base.started_ns = 0;
+		run_upload_job(&upload->base);
+		finish_upload_job(&upload->base, 0);
+		return 0;
+	}
+	if (fs_pool_submit(worker->fs_pool, &upload->base, worker->completions) != 0) {
+		log_msg(LOG_WARN, "Filesystem queue full, dropping upload of %s", upload->file.file_path);
+		upload->in_flight = 0;
+		admission_release(&worker->admission, upload->writing_len);
+		upload->writing_len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Answers the request, or only closes when http_code is 0, and gives the connection back to the loop.
+// The upload itself stays around until its disk job, if any, has finished.
+static void end_upload(Upload *upload, long http_code, int keep_alive) {
+	Worker *worker = upload->worker;
+	int client_fd = upload->client_fd;
+	if (client_fd < 0) return;
+
+	if (http_code) {
+		if (upload->trace) trace_resume(upload->trace);
+		if (http_code == 429) {
+			send_rate_limited(client_fd, !keep_alive);
+		} else if (http_code == 503) {
+			send_service_unavailable(client_fd, !keep_alive);
+		} else {
+			send_upload_status(client_fd, http_code, !keep_alive);
+		}
+		trace_mark(TRACE_LAST_BYTE_SENT);
+		trace_suspend();
+	}
+	trace_commit(worker->trace_ring, upload->trace);
+	upload->trace = NULL;
+
+	worker->clients[client_fd].upload = NULL;
+	upload->client_fd = -1;
+	if (!upload->reading) {
+		resume_client(worker, client_fd, keep_alive);
+	} else if (keep_alive) {
+		set_client_state(worker, client_fd, CONN_IDLE);
+	} else {
+		close_client(worker, client_fd);
+	}
+	upload->reading = 0;
+}
 
-	int server_socket, client_socket;
-	int epoll_fd, event_count;
-	struct epoll_event event, events[config.max_connections];
-	struct sockaddr_in server_addr, client_addr;
-	socklen_t client_len = sizeof(client_addr);
+// Removes the part file of an upload that was ended without being saved, then frees it.
+static void drop_upload(Upload *upload) {
+	if (upload->in_flight) return; // finish_upload_job() comes back here
+	if (upload->file.fd >= 0 && submit_upload(upload, UPLOAD_DISCARD) == 0) return;
+	upload_file_discard(&upload->file);
+	free_upload(upload);
+}
 
+static int set_upload_reading(Upload *upload, int reading) {
+	Worker *worker = upload->worker;
+	if (upload->reading == reading) return 0;
+	if (reading) {
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = upload->client_fd;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, upload->client_fd, &event) == -1) return -1;
+		// Time spent waiting for the disk is not the client's.
+		upload->last_progress_ns = trace_now_ns();
+		set_client_state(worker, upload->client_fd, CONN_ACTIVE);
+	} else {
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, upload->client_fd, NULL);
+		set_client_state(worker, upload->client_fd, CONN_QUEUED);
+	}
+	upload->reading = reading;
+	return 0;
+}
+
+// Decides what happens next once body bytes arrived or a disk job finished.
+static void upload_progress(Upload *upload) {
+	int full = upload->filled >= upload->batch;
+	int reading = !upload->body_done && !(full && upload->in_flight);
+	if (set_upload_reading(upload, reading) != 0) {
+		end_upload(upload, 0, 0);
+		drop_upload(upload);
+		return;
+	}
+	if (upload->in_flight || !(upload->body_done || full)) return;
+
+	if (submit_upload(upload, upload->body_done ? UPLOAD_COMMIT : UPLOAD_WRITE) != 0) {
+		end_upload(upload, 503, 0);
+		drop_upload(upload);
+	}
+}
+
+static void finish_upload_job(FsJob *job, int timed_out) {
+	Upload *upload = (Upload *)job;
+	Worker *worker = upload->worker;
+	upload->in_flight = 0;
+	admission_release(&worker->admission, upload->writing_len);
+	upload->writing_len = 0;
+	if (!timed_out && job->started_ns) sample_queue_wait(worker, job, job->started_ns);
+
+	if (upload->op == UPLOAD_DISCARD) {
+		if (timed_out) upload_file_discard(&upload->file);
+		free_upload(upload);
+		return;
+	}
+	// Answered at the deadline, or the client went away while the disk was busy.
+	if (upload->client_fd < 0) {
+		drop_upload(upload);
+		return;
+	}
+	if (upload->op_failed) {
+		// A client still waiting for 100 Continue has not sent its body, so the connection stays usable.
+		end_upload(upload, 500, upload->awaiting_continue && upload->keep_alive);
+		drop_upload(upload);
+		return;
+	}
+	if (upload->op == UPLOAD_COMMIT) {
+		end_upload(upload, 201, upload->keep_alive);
+		free_upload(upload);
+		return;
+	}
+	if (upload->awaiting_continue) {
+		upload->awaiting_continue = 0;
+		send_upload_status(upload->client_fd, 100, 0);
+	}
+	upload_progress(upload);
+}
+
+static void expire_upload_job(FsJob *job) {
+	Upload *upload = (Upload *)job;
+	sample_queue_wait(upload->worker, job, trace_now_ns());
+	log_msg(LOG_WARN, "Upload of %s expired in the filesystem queue", upload->file.file_path);
+	end_upload(upload, 503, upload->awaiting_continue && upload->keep_alive);
+}
+
+static int take_upload_data(void *ctx, const char *data, size_t len) {
+	Upload *upload = ctx;
+	// A chunked upload declares no length, so it is charged against the client's upload rate as it is decoded.
+	if (!rate_limiter_allow(upload->worker->limiter, upload->peer, RL_UPLOAD_BYTES, (double)len)) {
+		upload->refused = 429;
+		return -1;
+	}
+	memcpy(upload->filling + upload->filled, data, len);
+	upload->filled += len;
+	return 0;
+}
+
+// Takes body bytes from the client; never more than the free space in the filling buffer, which holds
+// at least as much decoded data. Returns -1 when the upload was refused and has been answered.
+static int consume_upload(Upload *upload, const char *data, size_t len) {
+	Worker *worker = upload->worker;
+	size_t before = upload->filled;
+	// Bytes past the body belong to a pipelined request, which is not kept for the next read,
+	// so the connection is closed after the response instead.
+	if (upload->chunked) {
+		ssize_t consumed = chunked_decode(&upload->decoder, data, len, take_upload_data, upload);
+		if (consumed < 0) {
+			if (upload->refused) {
+				printf("Upload of %s refused with %d\n", upload->file.file_path, upload->refused);
+			} else {
+				printf("Malformed chunked body for %s\n", upload->file.file_path);
+			}
+			upload->filled = before;
+			end_upload(upload, upload->refused ? upload->refused : 400, 0);
+			drop_upload(upload);
+			return -1;
+		}
+		upload->body_done = chunked_decoder_done(&upload->decoder);
+		if ((size_t)consumed < len) upload->keep_alive = 0;
+	} else {
+		size_t body_bytes = len < upload->remaining ? len : (size_t)upload->remaining;
+		if (body_bytes < len) upload->keep_alive = 0;
+		memcpy(upload->filling + upload->filled, data, body_bytes);
+		upload->filled += body_bytes;
+		upload->remaining -= body_bytes;
+		upload->body_done = upload->remaining == 0;
+	}
+
+	// Buffered body bytes count against the worker's in-flight budget until they are on disk.
+	size_t added = upload->filled - before;
+	if (admission_should_shed(&worker->admission, 0, added)) {
+		log_msg(LOG_DEBUG, "In-flight budget exceeded, aborting upload of %s", upload->file.file_path);
+		upload->filled = before;
+		end_upload(upload, 503, 0);
+		drop_upload(upload);
+		return -1;
+	}
+	admission_hold(&worker->admission, added);
+	return 0;
+}
+
+// Called when the connection of an upload is readable.
+static void receive_upload(Upload *upload) {
+	char data[UPLOAD_RECV_SIZE];
+	if (upload->filled >= upload->batch) return;
+	size_t want = upload->batch - upload->filled;
+	if (want > sizeof(data)) want = sizeof(data);
+	if (!upload->chunked && upload->remaining < want) want = (size_t)upload->remaining;
+	if (want == 0) return;
+
+	ssize_t received = recv(upload->client_fd, data, want, 0);
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+	if (received <= 0) {
+		printf("Upload of %s aborted by client\n", upload->file.file_path);
+		end_upload(upload, 0, 0);
+		drop_upload(upload);
+		return;
+	}
+	upload->last_progress_ns = trace_now_ns();
+	if (consume_upload(upload, data, (size_t)received) == 0) upload_progress(upload);
+}
+
+// The body is read on the loop, so a client that stops sending mid-upload is dropped here rather than
+// by a blocking receive. Uploads paused because the disk is behind are not the client's fault and wait.
+static void expire_idle_uploads(Worker *worker, uint64_t now_ns) {
+	Upload *upload = worker->uploads;
+	while (upload) {
+		Upload *next = upload->next;
+		if (upload->reading && now_ns - upload->last_progress_ns > (uint64_t)UPLOAD_IDLE_MS * 1000000ULL) {
+			log_msg(LOG_WARN, "Upload of %s stalled for %d ms, closing fd %d", upload->file.file_path,
+				UPLOAD_IDLE_MS, upload->client_fd);
+			end_upload(upload, 0, 0);
+			drop_upload(upload);
+		}
+		upload = next;
+	}
+}
 
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
+// Takes over the connection for a PUT to storage. Returns 1 when the upload owns the connection from now
+// on, 0 when the request was answered right away and *keep_alive is up to date.
+static int start_upload(Worker *worker, int client_fd, char *path, char *buffer, size_t bytes_read, uint32_t peer,
+	int *keep_alive) {
+	long content_length = request_content_length(buffer);
+	int chunked = strstr(buffer, "Transfer-Encoding: chunked") != NULL;
+	char *body_start = strstr(buffer, "\r\n\r\n");
+	if (content_length < 0) {
+		send_upload_status(client_fd, 400, 1);
+		*keep_alive = 0;
+		return 0;
+	}
+	if (content_length == 0 && !chunked) {
+		send_upload_status(client_fd, 411, 1);
+		*keep_alive = 0;
+		return 0;
+	}
+	if (!body_start) {
+		send_upload_status(client_fd, 400, 1);
+		*keep_alive = 0;
+		return 0;
+	}
+	// Both buffers together stay within what one request may hold of the in-flight budget, however long the body.
+	uint64_t batch = admission_max_hold(&worker->admission) / 2;
+	if (batch > UPLOAD_BATCH) batch = UPLOAD_BATCH;
+	if (batch == 0) batch = 1;
+	// The upload is found through the client table, so connections beyond it cannot upload.
+	Upload *upload = NULL;
+	if (client_fd < worker->max_fds && !admission_should_shed(&worker->admission, 0, 2 * batch)) {
+		upload = malloc(sizeof(Upload));
+	}
+	if (!upload) {
+		log_msg(LOG_DEBUG, "Cannot take an upload on fd %d", client_fd);
+		send_service_unavailable(client_fd, 1);
+		*keep_alive = 0;
+		return 0;
+	}
+
+	memset(upload, 0, offsetof(Upload, buffers));
+	upload->base.run = run_upload_job;
+	upload->base.done = finish_upload_job;
+	upload->base.expired = expire_upload_job;
+	upload->worker = worker;
+	upload->client_fd = client_fd;
+	upload->peer = peer;
+	upload->keep_alive = *keep_alive;
+	upload->chunked = chunked;
+	chunked_decoder_init(&upload->decoder);
+	upload->remaining = chunked ? 0 : (uint64_t)content_length;
+	upload->batch = (size_t)batch;
+	upload->reading = 1; // the request was just read from the epoll set
+	upload->filling = upload->buffers[0];
+	upload->writing = upload->buffers[1];
+	upload->last_progress_ns = trace_now_ns();
+	upload_file_init(&upload->file, path);
+	TraceRecord *trace = trace_current();
+	if (trace) {
+		upload->trace_storage = *trace;
+		upload->trace = &upload->trace_storage;
+	}
+	trace_suspend();
+
+	upload->next = worker->uploads;
+	if (worker->uploads) worker->uploads->prev = upload;
+	worker->uploads = upload;
+	worker->clients[client_fd].upload = upload;
+
+	body_start += 4;
+	size_t body_bytes = bytes_read - (size_t)(body_start - buffer);
+	if (strstr(buffer, "Expect: 100-continue") && body_bytes == 0) {
+		// The part file is opened before the client is told to go ahead, so a rejected upload never sends its body.
+		upload->awaiting_continue = 1;
+		if (set_upload_reading(upload, 0) != 0 || submit_upload(upload, UPLOAD_WRITE) != 0) {
+			end_upload(upload, 503, upload->keep_alive);
+			drop_upload(upload);
+		}
+		return 1;
+	}
+	if (body_bytes > 0 && consume_upload(upload, body_start, body_bytes) != 0) return 1;
+	upload_progress(upload);
+	return 1;
+}
+
+// Picks the listener of the worker on the CPU that took the packet, so a connection stays on one core.
+// Listeners join the SO_REUSEPORT group in worker order, which makes the group index the worker id.
+static void attach_cpu_steering(int listen_fd, int worker_count) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)worker_count },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+		log_msg(LOG_WARN, "SO_ATTACH_REUSEPORT_CBPF failed %d %s, connections are spread by hash", errno, strerror(errno));
+	}
+}
+
+static int create_listener(const ServerConfig *config, int cpu, int timestamps) {
+	int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_socket < 0) {
 		log_msg(LOG_ERROR, "Socket creation failed %d %s", errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = INADDR_ANY;
-	server_addr.sin_port = htons(config.port);
-
 	int optval = 1;
-	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0
+		|| setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
 		log_msg(LOG_ERROR, "Set socket options failed %d %s", errno, strerror(errno));
 		close(server_socket);
-		exit(EXIT_FAILURE);
+		return -1;
+	}
+
+	if (cpu >= 0 && setsockopt(server_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+		log_msg(LOG_WARN, "SO_INCOMING_CPU failed %d %s", errno, strerror(errno));
 	}
 
+	// Accepted sockets inherit the flag, so every request carries its kernel arrival time.
+	if (timestamps && setsockopt(server_socket, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0) {
+		log_msg(LOG_WARN, "SO_TIMESTAMPNS failed %d %s, queueing delay measured from wakeups", errno, strerror(errno));
+	}
+
+	// Wake up once the request has arrived instead of right after the handshake.
+	if (config->tcp_defer_accept > 0) {
+		int seconds = config->tcp_defer_accept;
+		if (setsockopt(server_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) < 0) {
+			log_msg(LOG_WARN, "TCP_DEFER_ACCEPT failed %d %s", errno, strerror(errno));
+		}
+	}
+
+	if (config->tcp_fastopen > 0) {
+		int queue_len = config->tcp_fastopen;
+		if (setsockopt(server_socket, IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len)) < 0) {
+			log_msg(LOG_WARN, "TCP_FASTOPEN failed %d %s", errno, strerror(errno));
+		}
+	}
+
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+	server_addr.sin_port = htons(config->port);
+
 	if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
 		log_msg(LOG_ERROR, "Bind failed %d %s", errno, strerror(errno));
 		close(server_socket);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	if (listen(server_socket, config.max_connections) < 0) {
+	if (listen(server_socket, config->max_connections) < 0) {
 		log_msg(LOG_ERROR, "Listen failed %d %s", errno, strerror(errno));
 		close(server_socket);
-		exit(EXIT_FAILURE);
+		return -1;
+	}
+	return server_socket;
+}
+
+static int init_worker(Worker *worker, int id, const ServerConfig *config, FsPool *fs_pool, RateLimiter *limiter) {
+	memset(worker, 0, sizeof(*worker));
+	worker->id = id;
+	worker->config = config;
+	worker->fs_pool = fs_pool;
+	worker->limiter = limiter;
+	worker->cpu = -1;
+	if (config->pin_workers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus > 0) worker->cpu = id % (int)cpus;
+	}
+
+	// Per-connection state of every open client socket, indexed by fd. The descriptor limit can be huge
+	// (LimitNOFILE=infinity), so the table is capped; connections on higher fds are served but not tracked.
+	worker->max_fds = sysconf(_SC_OPEN_MAX);
+	if (worker->max_fds <= 0) worker->max_fds = 1024;
+	if (worker->max_fds > CLIENT_TABLE_MAX) worker->max_fds = CLIENT_TABLE_MAX;
+	worker->clients = calloc(worker->max_fds, sizeof(ClientInfo));
+	worker->events = calloc(config->max_connections, sizeof(struct epoll_event));
+	if (!worker->clients || !worker->events) {
+		log_msg(LOG_ERROR, "Client table allocation failed");
+		return -1;
 	}
 
-	epoll_fd = epoll_create1(0);
-	if (epoll_fd <= 0) {
+	worker->trace_ring = trace_ring_create(TRACE_RING_SIZE, config->trace_sample_rate, config->trace_slow_ms);
+	admission_init(&worker->admission, config->admission_target_ms, config->admission_interval_ms,
+		config->admission_inflight_bytes);
+
+	worker->listen_fd = create_listener(config, worker->cpu, admission_enabled(&worker->admission));
+	if (worker->listen_fd < 0) return -1;
+	if (id == 0 && config->reuseport_cpu_steering && config->workers > 1) {
+		attach_cpu_steering(worker->listen_fd, config->workers);
+	}
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll_fd < 0) {
 		log_msg(LOG_ERROR, "Epoll create failed %d %s", errno, strerror(errno));
-		close(server_socket);
+		return -1;
 	}
 
+	struct epoll_event event;
 	event.events = EPOLLIN;
-	event.data.fd = server_socket;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+	event.data.fd = worker->listen_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &event) == -1) {
 		log_msg(LOG_ERROR, "Epoll ctl failed %d %s", errno, strerror(errno));
-		close(server_socket);
-		close(epoll_fd);
-		exit(EXIT_FAILURE);
+		return -1;
+	}
+
+	if (fs_pool) {
+		worker->completions = fs_completion_queue_create();
+		if (!worker->completions) {
+			log_msg(LOG_ERROR, "Completion queue creation failed");
+			return -1;
+		}
+		event.events = EPOLLIN;
+		event.data.fd = fs_completion_queue_fd(worker->completions);
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) == -1) {
+			log_msg(LOG_ERROR, "Epoll ctl failed %d %s", errno, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Drains the accept backlog in one wakeup instead of taking one connection per epoll_wait().
+static void accept_clients(Worker *worker) {
+	struct sockaddr_in client_addr;
+	for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+		socklen_t client_len = sizeof(client_addr);
+		int client_socket = accept4(worker->listen_fd, (struct sockaddr *)&client_addr, &client_len,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_socket == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_msg(LOG_WARN, "Accept failed %d %s", errno, strerror(errno));
+			}
+			return;
+		}
+
+		if (!rate_limiter_allow(worker->limiter, client_addr.sin_addr.s_addr, RL_CONNECTIONS, 1)) {
+			char addr_text[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &client_addr.sin_addr, addr_text, sizeof(addr_text));
+			log_msg(LOG_DEBUG, "Connection rate limit exceeded for %s", addr_text);
+			send_rate_limited(client_socket, 1);
+			close(client_socket);
+			continue;
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = client_socket;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+			close(client_socket);
+			continue;
+		}
+		track_client(worker, client_socket, &client_addr);
+		atomic_fetch_add(&worker->accepted, 1);
+		printf("New client connected %d\n", client_socket);
+	}
+}
+
+// Reads the start of a request and how long it sat in the socket: from the kernel receive timestamp when
+// the socket has SO_TIMESTAMPNS, else from the loop wakeup that reported it.
+static ssize_t recv_request(int client_fd, char *buffer, size_t size, uint64_t wakeup_ns, uint64_t *delay_ns) {
+	struct iovec iov = { buffer, size };
+	char control[REQUEST_CMSG_SIZE];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t bytes_read = recvmsg(client_fd, &msg, 0);
+
+	uint64_t now = trace_now_ns();
+	*delay_ns = wakeup_ns && now > wakeup_ns ? now - wakeup_ns : 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); bytes_read > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec arrived, real_now;
+			memcpy(&arrived, CMSG_DATA(cmsg), sizeof(arrived));
+			clock_gettime(CLOCK_REALTIME, &real_now);
+			int64_t waited = (int64_t)(real_now.tv_sec - arrived.tv_sec) * 1000000000LL + (real_now.tv_nsec - arrived.tv_nsec);
+			*delay_ns = waited > 0 ? (uint64_t)waited : 0;
+		}
+	}
+	return bytes_read;
+}
+
+static void handle_client(Worker *worker, int client_fd, uint64_t wakeup_ns) {
+	ClientInfo *client = client_fd < worker->max_fds ? &worker->clients[client_fd] : NULL;
+	if (client && client->upload) {
+		receive_upload(client->upload);
+		return;
+	}
+	TraceRecord trace;
+	trace_begin(worker->trace_ring, &trace, client_fd, client ? client->accepted_ns : 0, wakeup_ns);
+	char buffer[1024];
+	uint64_t delay_ns;
+	ssize_t bytes_read = recv_request(client_fd, buffer, sizeof(buffer) - 1, wakeup_ns, &delay_ns);
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		trace_suspend();
+		return;
+	}
+	if (bytes_read <= 0) {
+		trace_end();
+		close_client(worker, client_fd);
+		return;
+	}
+
+	trace_mark(TRACE_FIRST_BYTE);
+	admission_sample(&worker->admission, delay_ns, trace_now_ns());
+	buffer[bytes_read] = '\0';
+	// Rejected before parsing or touching storage, the cheapest point. The connection is kept so the client
+	// does not have to reconnect, unless a body is still on the wire.
+	if (admission_should_shed(&worker->admission, delay_ns, 0)) {
+		log_msg(LOG_DEBUG, "Overloaded, shedding request on fd %d after %llu us in queue", client_fd,
+			(unsigned long long)(delay_ns / 1000));
+		int close_connection = request_has_body(buffer) || strstr(buffer, "Connection: close") != NULL;
+		send_service_unavailable(client_fd, close_connection);
+		trace_end();
+		if (close_connection) {
+			close_client(worker, client_fd);
+		} else {
+			set_client_state(worker, client_fd, CONN_IDLE);
+		}
+		return;
+	}
+	if (client) {
+		client->accepted_ns = 0;
+		atomic_fetch_add(&client->requests, 1);
+	}
+	set_client_state(worker, client_fd, CONN_ACTIVE);
+	atomic_fetch_add(&worker->requests, 1);
+	int keep_alive = 1;
+	char method[16], path[256], protocol[16];
+	sscanf(buffer, "%s %s %s", method, path, protocol);
+	trace_set_request(method, path);
+	trace_mark(TRACE_HEADERS_PARSED);
+	printf("Received request: %s %s %s\n", method, path, protocol);
+	if (strstr(buffer, "Connection: close")) {
+		keep_alive = 0;
+	}
+	uint32_t peer = client ? client->addr : 0;
+	int deferred = 0;
+	const AssetEntry *asset = NULL;
+	trace_mark(TRACE_HANDLER_START);
+	if (!rate_limiter_allow(worker->limiter, peer, RL_REQUESTS, 1)) {
+		log_msg(LOG_DEBUG, "Request rate limit exceeded on fd %d", client_fd);
+		if (request_has_body(buffer)) keep_alive = 0;
+		send_rate_limited(client_fd, !keep_alive);
+	} else if (strncmp(path, "/storage", 8) == 0) {
+		if (strcmp(method, "PUT") == 0) {
+			if (!rate_limiter_allow(worker->limiter, peer, RL_UPLOAD_BYTES, (double)request_content_length(buffer))) {
+				// The body is already on its way, close instead of parsing it as the next request.
+				send_rate_limited(client_fd, 1);
+				keep_alive = 0;
+			} else {
+				deferred = start_upload(worker, client_fd, path, buffer, bytes_read, peer, &keep_alive);
+			}
+		} else if (strcmp(method, "GET") == 0) {
+			deferred = dispatch_file_route(worker, FILE_ROUTE_DOWNLOAD, client_fd, path, NULL, buffer, &keep_alive);
+		} else {
+			deferred = dispatch_file_route(worker, FILE_ROUTE_NOT_ALLOWED, client_fd, path, NULL, buffer, &keep_alive);
+		}
+	} else if (strcmp(method, "GET") == 0 && (asset = asset_bundle_lookup(path)) != NULL) {
+		deferred = dispatch_file_route(worker, FILE_ROUTE_ASSET, client_fd, path, asset, buffer, &keep_alive);
+	} else if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
+		deferred = dispatch_file_route(worker, FILE_ROUTE_INDEX, client_fd, path, NULL, buffer, &keep_alive);
+	} else if (strcmp(path, "/test-404") == 0) {
+		http_get("https://httpbin.org/status/404", client_fd);
+	} else if (strcmp(path, "/test-403") == 0) {
+		http_get("https://httpbin.org/status/403", client_fd);
+	} else if (strcmp(path, "/test-501") == 0) {
+		http_get("https://httpbin.org/status/501", client_fd);
+	} else if (strcmp(path, "/test-400") == 0) {
+		http_get("https://httpbin.org/status/400", client_fd);
+	} else if (strcmp(path, "/broken-link") == 0) {
+		http_get("https://httpbin.org/status/503", client_fd);
+	} else if (strcmp(path, "/post-test") == 0) {
+		http_post("https://httpbin.org/post", client_fd);
+	} else if (strcmp(path, "/delete-test") == 0) {
+		http_delete("https://httpbin.org/delete", client_fd);
+	} else if (strcmp(path, "/put-test") == 0) {
+		http_put("https://httpbin.org/put", "test_file.txt", client_fd);
+	} else {
+		deferred = dispatch_file_route(worker, FILE_ROUTE_NOT_FOUND, client_fd, path, NULL, buffer, &keep_alive);
+	}
+	if (deferred) return;
+	trace_mark(TRACE_LAST_BYTE_SENT);
+	trace_end();
+	if (keep_alive == 0) {
+		close_client(worker, client_fd);
+	} else {
+		set_client_state(worker, client_fd, CONN_IDLE);
+	}
+}
+
+// Runs on the worker after the admin port asked for it, so no other thread ever closes its sockets.
+static void drop_idle_clients(Worker *worker, long idle_ms) {
+	uint64_t cutoff = trace_now_ns() - (uint64_t)idle_ms * 1000000ULL;
+	long fd_limit = atomic_load(&worker->fd_limit);
+	uint64_t dropped = 0;
+	for (long fd = 0; fd < fd_limit; fd++) {
+		ClientInfo *client = &worker->clients[fd];
+		if (atomic_load(&client->state) != CONN_IDLE || atomic_load(&client->last_active_ns) > cutoff) continue;
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, (int)fd, NULL);
+		close_client(worker, (int)fd);
+		dropped++;
+	}
+	atomic_fetch_add(&worker->dropped_idle, dropped);
+	log_msg(LOG_INFO, "Worker %d dropped %llu connections idle for %ld ms", worker->id, (unsigned long long)dropped, idle_ms);
+}
+
+static void dump_diagnostics(Worker *worker) {
+	const ServerConfig *config = worker->config;
+	if (worker->trace_ring) {
+		char trace_path[300];
+		if (worker->id == 0) {
+			snprintf(trace_path, sizeof(trace_path), "%s", config->trace_file);
+		} else {
+			snprintf(trace_path, sizeof(trace_path), "%s.%d", config->trace_file, worker->id);
+		}
+		if (trace_ring_dump(worker->trace_ring, trace_path, worker->id) == 0) {
+			log_msg(LOG_INFO, "Request trace written to %s", trace_path);
+		} else {
+			log_msg(LOG_ERROR, "Could not write request trace to %s %d %s", trace_path, errno, strerror(errno));
+		}
+	}
+	// The pool is shared, one report is enough.
+	if (worker->id == 0 && worker->fs_pool) {
+		FsPoolStats stats;
+		fs_pool_stats(worker->fs_pool, &stats);
+		log_msg(LOG_INFO, "Filesystem pool: queued=%zu max_queued=%zu submitted=%llu completed=%llu rejected=%llu timed_out=%llu late=%llu",
+			stats.queued, stats.max_queued, (unsigned long long)stats.submitted, (unsigned long long)stats.completed,
+			(unsigned long long)stats.rejected, (unsigned long long)stats.timed_out, (unsigned long long)stats.late);
+	}
+}
+
+// Leaves new connections in this worker's accept queue while it is over its budgets; the kernel does not hand
+// them to other workers, since it picks the listener when the SYN arrives.
+static void update_accepting(Worker *worker) {
+	int accepting = admission_accepting(&worker->admission);
+	int paused = atomic_load(&worker->accept_paused);
+	if (accepting == !paused) return;
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = worker->listen_fd;
+	if (accepting) {
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &event) == -1) return;
+		log_msg(LOG_INFO, "Worker %d accepting connections again", worker->id);
+	} else {
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listen_fd, NULL) == -1) return;
+		log_msg(LOG_WARN, "Worker %d over budget (queueing delay %llu us, %llu bytes in flight), pausing accepts",
+			worker->id, (unsigned long long)(atomic_load(&worker->admission.min_delay_ns) / 1000),
+			(unsigned long long)atomic_load(&worker->admission.inflight_bytes));
 	}
+	atomic_store(&worker->accept_paused, !accepting);
+}
 
-	log_msg(LOG_INFO, "Server listening on port %d", config.port);
+static void *worker_loop(void *arg) {
+	Worker *worker = arg;
+	const ServerConfig *config = worker->config;
 
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err != 0) {
+			log_msg(LOG_WARN, "Could not pin worker %d to CPU %d: %s", worker->id, worker->cpu, strerror(err));
+		}
+	}
+
+	int completion_fd = worker->completions ? fs_completion_queue_fd(worker->completions) : -1;
+	int admission = admission_enabled(&worker->admission);
 	while (1) {
-		event_count = epoll_wait(epoll_fd, events, config.max_connections, -1);
-		log_msg(LOG_DEBUG, "Epoll wait returned %d", event_count);
+		// The timeout lets every worker notice SIGUSR1, which interrupts only one of them. While accepting
+		// is paused the loop also has to wake up to notice that the overload is over.
+		int timeout = atomic_load(&worker->accept_paused) ? (int)(worker->admission.interval_ns / 1000000) : EPOLL_TIMEOUT_MS;
+		// Jobs past their deadline are answered now, not when a pool thread gets to them, so the wait is
+		// also cut short at the next deadline.
+		uint64_t now = trace_now_ns();
+		if (worker->completions) {
+			uint64_t next_deadline = fs_completion_queue_expire(worker->completions, now);
+			if (next_deadline) {
+				int until_deadline = (int)((next_deadline - now + 999999) / 1000000);
+				if (until_deadline < timeout) timeout = until_deadline;
+			}
+		}
+		if (worker->uploads) expire_idle_uploads(worker, now);
+		int event_count = epoll_wait(worker->epoll_fd, worker->events, config->max_connections, timeout);
+		uint64_t wakeup_ns = worker->trace_ring || admission ? trace_now_ns() : 0;
+		if (event_count > 0) log_msg(LOG_DEBUG, "Epoll wait returned %d", event_count);
+		if (worker->seen_dump != dump_generation) {
+			worker->seen_dump = dump_generation;
+			dump_diagnostics(worker);
+		}
+		// Finished filesystem jobs first, then requests on open connections, new connections last:
+		// under load the work already paid for completes before more is taken on.
+		int listener_ready = 0;
 		for (int i = 0; i < event_count; i++) {
-			if (events[i].data.fd == server_socket) {
-				client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-				if (client_socket == -1) continue;
-
-				event.events = EPOLLIN;
-				event.data.fd = client_socket;
-				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event);
-				printf("New client connected %d\n", client_socket);
-			} else {
-				int client_fd = events[i].data.fd;
-				char buffer[1024];
-				ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-				if (bytes_read <= 0) {
-					close(client_fd);
-				} else {
-					buffer[bytes_read] = '\0';
-					int keep_alive = 1;
-					char method[16], path[256], protocol[16];
-					sscanf(buffer, "%s %s %s", method, path, protocol);
-					printf("Received request: %s %s %s\n", method, path, protocol);
-					if (strstr(buffer, "Connection: close")) {
-						keep_alive = 0;
-					}
-					if (strncmp(path, "/storage", 8) == 0) {
-						if (strcmp(method, "PUT") == 0) {
-							handle_file_upload(client_fd, path, buffer, bytes_read);
-						} else if (strcmp(method, "GET") == 0) {
-							handle_file_download(client_fd, path);
-						} else {
-							send_error_html(client_fd, "file/405.html", 405);
-						}
-					} else if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
-						send_html(client_fd, "file/index.html");
-					} else if (strcmp(path, "/test-404") == 0) {
-						http_get("https://httpbin.org/status/404", client_fd);
-					} else if (strcmp(path, "/test-403") == 0) {
-						http_get("https://httpbin.org/status/403", client_fd);
-					} else if (strcmp(path, "/test-501") == 0) {
-						http_get("https://httpbin.org/status/501", client_fd);
-					} else if (strcmp(path, "/test-400") == 0) {
-						http_get("https://httpbin.org/status/400", client_fd);
-					} else if (strcmp(path, "/broken-link") == 0) {
-						http_get("https://httpbin.org/status/503", client_fd);
-					} else if (strcmp(path, "/post-test") == 0) {
-						http_post("https://httpbin.org/post", client_fd);
-					} else if (strcmp(path, "/delete-test") == 0) {
-						http_delete("https://httpbin.org/delete", client_fd);
-					} else if (strcmp(path, "/put-test") == 0) {
-						http_put("https://httpbin.org/put", "test_file.txt", client_fd);
-					} else {
-						send_error_html(client_fd, "file/404.html", 404);
-					}
-					if (keep_alive == 0) {
-						close(client_fd);
-					}
-				}
+			int fd = worker->events[i].data.fd;
+			if (fd == completion_fd) {
+				fs_completion_queue_drain(worker->completions);
+			} else if (fd == worker->listen_fd) {
+				listener_ready = 1;
 			}
 		}
+		for (int i = 0; i < event_count; i++) {
+			int fd = worker->events[i].data.fd;
+			if (fd != completion_fd && fd != worker->listen_fd) {
+				handle_client(worker, fd, wakeup_ns);
+			}
+		}
+		if (admission) {
+			admission_tick(&worker->admission, trace_now_ns());
+			update_accepting(worker);
+		}
+		if (listener_ready && !atomic_load(&worker->accept_paused)) {
+			accept_clients(worker);
+		}
+		// After the events, so no fd in this batch is closed under its own handler.
+		long idle_ms = atomic_exchange(&worker->drop_idle_ms, 0);
+		if (idle_ms > 0) drop_idle_clients(worker, idle_ms);
+	}
+	return NULL;
+}
+
+int setup_server() {
+
+	static ServerConfig config;
+	load_config("config.json", &config);
+
+	LogLevel log_level = config.debug_mode ? LOG_DEBUG : LOG_INFO;
+	logger_init(log_level, config.log_file);
+
+	log_msg(LOG_INFO, "Server configuration loaded: IP=%s, Port=%d, Max Connections=%d, Root Dir=%s, Log File=%s",
+		config.ip, config.port, config.max_connections, config.root_directory, config.log_file);
+
+	log_msg(LOG_DEBUG, "Debug mode is ON. Detailed logs enabled.");
+
+	if (prepare_unavailable_page("file/503.html") != 0) {
+		log_msg(LOG_WARN, "Could not load file/503.html, overload responses use plain text");
 	}
 
+	// Handlers write to sockets whose peer may already be gone.
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_dump_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	if (config.trace_sample_rate > 0 || config.trace_slow_ms > 0) {
+		log_msg(LOG_INFO, "Request tracing enabled (1 in %d, slow >= %d ms), send SIGUSR1 to write %s",
+			config.trace_sample_rate, config.trace_slow_ms, config.trace_file);
+	}
+
+	if (http_methods_init() != 0) {
+		log_msg(LOG_WARN, "libcurl could not be initialized, proxy routes will fail");
+	}
+
+	if (config.workers <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.workers = cpus > 0 ? (int)cpus : 1;
+	}
+
+	FsPool *fs_pool = fs_pool_create(config.fs_threads, config.fs_queue_size, config.fs_queue_timeout_ms);
+	if (fs_pool) {
+		log_msg(LOG_INFO, "Filesystem pool started with %d threads, queue size %d, queue timeout %d ms",
+			config.fs_threads, config.fs_queue_size, config.fs_queue_timeout_ms);
+	} else if (config.fs_threads > 0) {
+		log_msg(LOG_WARN, "Filesystem pool could not be started, serving files on the event loop");
+	}
+
+	// Shared by all workers, so per-client limits hold whichever worker a connection lands on.
+	RateLimitRule rate_rules[RL_KIND_COUNT] = {
+		[RL_CONNECTIONS] = { config.rate_limit_connections, config.rate_limit_connections_burst },
+		[RL_REQUESTS] = { config.rate_limit_requests, config.rate_limit_requests_burst },
+		[RL_UPLOAD_BYTES] = { config.rate_limit_upload_bytes, config.rate_limit_upload_bytes_burst },
+	};
+	RateLimiter *limiter = rate_limiter_create(rate_rules, RATE_LIMIT_TABLE_SIZE);
+	if (!limiter) {
+		log_msg(LOG_ERROR, "Rate limiter allocation failed");
+		exit(EXIT_FAILURE);
+	}
+
+	if (asset_bundle_open(config.asset_bundle) == 0) {
+		log_msg(LOG_INFO, "Serving static assets from bundle %s", config.asset_bundle);
+	}
+
+	if (proxy_cache_init((size_t)config.proxy_cache_size, config.proxy_cache_shards,
+		config.proxy_cache_spill_dir, config.proxy_cache_default_ttl) == 0) {
+		log_msg(LOG_INFO, "Proxy cache enabled: %.0f bytes in %d shards, spill dir '%s', default TTL %d s",
+			config.proxy_cache_size, config.proxy_cache_shards, config.proxy_cache_spill_dir, config.proxy_cache_default_ttl);
+	}
+
+	// Listeners are opened here in worker order so the SO_REUSEPORT group index matches the worker id.
+	Worker *workers = calloc(config.workers, sizeof(Worker));
+	if (!workers) {
+		log_msg(LOG_ERROR, "Worker allocation failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < config.workers; i++) {
+		if (init_worker(&workers[i], i, &config, fs_pool, limiter) != 0) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	log_msg(LOG_INFO, "Server listening on port %d with %d workers%s", config.port, config.workers,
+		config.pin_workers ? " pinned to CPUs" : "");
+
+	if (admin_start(&config, workers, config.workers, fs_pool) == 0) {
+		log_msg(LOG_INFO, "Admin endpoint listening on 127.0.0.1:%d", config.admin_port);
+	}
+
+	for (int i = 1; i < config.workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+			log_msg(LOG_ERROR, "Could not start worker %d", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	worker_loop(&workers[0]);
+
+	for (int i = 1; i < config.workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	admin_stop();
+	fs_pool_destroy(fs_pool);
+	for (int i = 0; i < config.workers; i++) {
+		fs_completion_queue_destroy(workers[i].completions);
+		free(workers[i].clients);
+		free(workers[i].events);
+		trace_ring_destroy(workers[i].trace_ring);
+		close(workers[i].epoll_fd);
+		close(workers[i].listen_fd);
+	}
+	free(workers);
+	rate_limiter_destroy(limiter);
+	proxy_cache_destroy();
+	http_methods_cleanup();
+	asset_bundle_close();
 	logger_close();
-	close(server_socket);
-	return client_socket;
-}
\ No newline at end of file
+	return 0;
+}
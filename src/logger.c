@@ -2,9 +2,12 @@
 #include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
 #include "../include/logger.h"
 
-static LogLevel current_level = LOG_INFO;
+// Changed at runtime from the admin thread while workers log.
+static atomic_int current_level = LOG_INFO;
 static FILE *log_file_ptr = NULL;
 
 static const char *level_strings[] = {
@@ -16,7 +19,7 @@ static const char *level_colors[] = {
 };
 
 void logger_init(LogLevel level, const char *file_path) {
-	current_level = level;
+	atomic_store(&current_level, level);
 
 	if (log_file_ptr) {
 		fclose(log_file_ptr);
@@ -38,13 +41,36 @@ void logger_close() {
 	}
 }
 
+void logger_set_level(LogLevel level) {
+	atomic_store(&current_level, level);
+}
+
+LogLevel logger_get_level() {
+	return (LogLevel)atomic_load(&current_level);
+}
+
+const char *logger_level_name(LogLevel level) {
+	return level_strings[level];
+}
+
+int logger_parse_level(const char *name, LogLevel *level) {
+	for (int i = LOG_DEBUG; i <= LOG_FATAL; i++) {
+		if (strcasecmp(name, level_strings[i]) == 0) {
+			*level = (LogLevel)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
 void log_msg(LogLevel level, const char *format, ...) {
-	if (level < current_level) return;
+	if (level < (LogLevel)atomic_load(&current_level)) return;
 
 	time_t now = time(NULL);
-	struct tm *t = localtime(&now);
+	struct tm t;
+	localtime_r(&now, &t);
 	char time_str[20];
-	strftime(time_str, sizeof(time_str), "%H:%M:%S", t);
+	strftime(time_str, sizeof(time_str), "%H:%M:%S", &t);
 
 	va_list args;
 
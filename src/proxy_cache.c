@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "../include/proxy_cache.h"
+#include "../include/logger.h"
+
+#define CACHE_BUCKETS_PER_SHARD 256
+#define SPILL_MAGIC 0x50435331u
+#define FETCH_WAIT_MS 2000
+
+typedef struct CacheEntry {
+	char *url;
+	uint64_t hash;
+	long http_code;
+	char *body;
+	size_t size;
+	char etag[128];
+	char last_modified[64];
+	char content_type[128];
+	time_t fresh_until;
+	int valid;    // holds a response (may be stale)
+	int fetching; // one caller is talking to the upstream for this url
+	struct CacheEntry *chain;
+	struct CacheEntry *prev;
+	struct CacheEntry *next;
+} CacheEntry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t fetched;
+	CacheEntry *buckets[CACHE_BUCKETS_PER_SHARD];
+	CacheEntry *lru_head; // most recently used
+	CacheEntry *lru_tail;
+	size_t bytes;
+	size_t budget;
+	size_t entries;
+	uint64_t hits;
+	uint64_t misses;
+} CacheShard;
+
+typedef struct {
+	uint32_t magic;
+	long http_code;
+	int64_t fresh_until;
+	char etag[128];
+	char last_modified[64];
+	char content_type[128];
+	uint64_t url_len;
+	uint64_t size;
+} SpillHeader;
+
+static CacheShard *shards = NULL;
+static int shard_total = 0;
+static char spill_directory[256] = "";
+static long default_freshness = 0;
+
+static uint64_t hash_url(const char *url) {
+	uint64_t h = 1469598103934665603ULL;
+	for (const unsigned char *p = (const unsigned char *)url; *p; p++) {
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static CacheShard *shard_for(uint64_t hash) {
+	return &shards[(hash >> 32) % (uint64_t)shard_total];
+}
+
+static size_t entry_cost(const CacheEntry *entry) {
+	return sizeof(CacheEntry) + strlen(entry->url) + 1 + entry->size;
+}
+
+static void lru_unlink(CacheShard *shard, CacheEntry *entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else shard->lru_head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else shard->lru_tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(CacheShard *shard, CacheEntry *entry) {
+	entry->prev = NULL;
+	entry->next = shard->lru_head;
+	if (shard->lru_head) shard->lru_head->prev = entry;
+	shard->lru_head = entry;
+	if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+static CacheEntry *find_entry(CacheShard *shard, const char *url, uint64_t hash) {
+	CacheEntry *entry = shard->buckets[hash % CACHE_BUCKETS_PER_SHARD];
+	while (entry && (entry->hash != hash || strcmp(entry->url, url) != 0)) {
+		entry = entry->chain;
+	}
+	return entry;
+}
+
+static void spill_path(char *out, size_t size, uint64_t hash) {
+	snprintf(out, size, "%s/%016llx.cache", spill_directory, (unsigned long long)hash);
+}
+
+// Written under a name of its own and renamed into place, so a concurrent lookup sees either no file or all of it.
+static void spill_entry(const CacheEntry *entry) {
+	char path[320];
+	char tmp_path[352];
+	spill_path(path, sizeof(path), entry->hash);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%lx.tmp", path, (unsigned long)pthread_self());
+	FILE *fp = fopen(tmp_path, "wb");
+	if (!fp) return;
+
+	SpillHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SPILL_MAGIC;
+	header.http_code = entry->http_code;
+	header.fresh_until = entry->fresh_until;
+	memcpy(header.etag, entry->etag, sizeof(header.etag));
+	memcpy(header.last_modified, entry->last_modified, sizeof(header.last_modified));
+	memcpy(header.content_type, entry->content_type, sizeof(header.content_type));
+	header.url_len = strlen(entry->url);
+	header.size = entry->size;
+
+	int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(entry->url, 1, header.url_len, fp) == header.url_len
+		&& fwrite(entry->body, 1, entry->size, fp) == entry->size;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp_path, path) != 0) unlink(tmp_path);
+}
+
+// Moves a spilled response back into entry; the file is removed either way.
+static void unspill_entry(CacheEntry *entry) {
+	char path[320];
+	spill_path(path, sizeof(path), entry->hash);
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return;
+
+	SpillHeader header;
+	char *url = NULL;
+	char *body = NULL;
+	if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == SPILL_MAGIC
+		&& header.url_len == strlen(entry->url)) {
+		url = malloc(header.url_len + 1);
+		body = malloc(header.size + 1);
+	}
+	if (url && body && fread(url, 1, header.url_len, fp) == header.url_len
+		&& memcmp(url, entry->url, header.url_len) == 0
+		&& fread(body, 1, header.size, fp) == header.size) {
+		body[header.size] = '\0';
+		entry->body = body;
+		entry->size = header.size;
+		entry->http_code = header.http_code;
+		entry->fresh_until = (time_t)header.fresh_until;
+		memcpy(entry->etag, header.etag, sizeof(entry->etag));
+		memcpy(entry->last_modified, header.last_modified, sizeof(entry->last_modified));
+		memcpy(entry->content_type, header.content_type, sizeof(entry->content_type));
+		entry->etag[sizeof(entry->etag) - 1] = '\0';
+		entry->last_modified[sizeof(entry->last_modified) - 1] = '\0';
+		entry->content_type[sizeof(entry->content_type) - 1] = '\0';
+		entry->valid = 1;
+		body = NULL;
+	}
+	free(url);
+	free(body);
+	fclose(fp);
+	unlink(path);
+}
+
+static void free_entry(CacheEntry *entry) {
+	free(entry->url);
+	free(entry->body);
+	free(entry);
+}
+
+// Takes the entry out of the shard; once detached, no other thread can reach it.
+static void detach_entry(CacheShard *shard, CacheEntry *entry) {
+	CacheEntry **link = &shard->buckets[entry->hash % CACHE_BUCKETS_PER_SHARD];
+	while (*link != entry) link = &(*link)->chain;
+	*link = entry->chain;
+	lru_unlink(shard, entry);
+	shard->bytes -= entry_cost(entry);
+	shard->entries--;
+}
+
+static void remove_entry(CacheShard *shard, CacheEntry *entry) {
+	detach_entry(shard, entry);
+	free_entry(entry);
+}
+
+// Returns the evicted entries that still have to be spilled, chained through next. They are written by
+// spill_evicted() after the shard lock is released, so disk writes never stall other lookups on the shard.
+static CacheEntry *evict_over_budget(CacheShard *shard) {
+	CacheEntry *to_spill = NULL;
+	CacheEntry *entry = shard->lru_tail;
+	while (entry && shard->bytes > shard->budget) {
+		CacheEntry *prev = entry->prev;
+		if (!entry->fetching) {
+			detach_entry(shard, entry);
+			if (entry->valid && spill_directory[0]) {
+				entry->next = to_spill;
+				to_spill = entry;
+			} else {
+				free_entry(entry);
+			}
+		}
+		entry = prev;
+	}
+	return to_spill;
+}
+
+static void spill_evicted(CacheEntry *entry) {
+	while (entry) {
+		CacheEntry *next = entry->next;
+		spill_entry(entry);
+		free_entry(entry);
+		entry = next;
+	}
+}
+
+static void copy_response(const CacheEntry *entry, long *http_code, struct MemoryStruct *body, ProxyCacheMeta *meta) {
+	*http_code = entry->http_code;
+	memcpy(meta->content_type, entry->content_type, sizeof(meta->content_type));
+	body->memory = malloc(entry->size + 1);
+	body->size = 0;
+	if (body->memory) {
+		memcpy(body->memory, entry->body, entry->size);
+		body->memory[entry->size] = '\0';
+		body->size = entry->size;
+	}
+}
+
+static int explicit_freshness(const ProxyCacheMeta *meta) {
+	return meta->max_age >= 0 || meta->expires != 0;
+}
+
+// Statuses a cache may keep without explicit freshness (RFC 9110, 15.1). Server errors are left out,
+// so one failing upstream call is not replayed for the whole default TTL.
+static int heuristically_cacheable(long http_code) {
+	switch (http_code) {
+		case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+		case 404: case 405: case 410: case 414:
+			return 1;
+	}
+	return 0;
+}
+
+static time_t fresh_until(const ProxyCacheMeta *meta, long http_code, time_t now) {
+	if (meta->no_cache) return now;
+	if (meta->max_age >= 0) return now + meta->max_age - meta->age;
+	if (meta->expires) return meta->expires;
+	return heuristically_cacheable(http_code) ? now + default_freshness : now;
+}
+
+int proxy_cache_init(size_t budget, int shard_count, const char *spill_dir, long default_ttl) {
+	if (budget == 0) return -1;
+	if (shard_count <= 0) shard_count = 1;
+
+	shards = calloc(shard_count, sizeof(CacheShard));
+	if (!shards) return -1;
+
+	shard_total = shard_count;
+	for (int i = 0; i < shard_count; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		pthread_cond_init(&shards[i].fetched, NULL);
+		shards[i].budget = budget / shard_count;
+	}
+	snprintf(spill_directory, sizeof(spill_directory), "%s", spill_dir ? spill_dir : "");
+	default_freshness = default_ttl;
+	return 0;
+}
+
+void proxy_cache_destroy() {
+	if (!shards) return;
+	for (int i = 0; i < shard_total; i++) {
+		while (shards[i].lru_head) {
+			remove_entry(&shards[i], shards[i].lru_head);
+		}
+		pthread_mutex_destroy(&shards[i].lock);
+		pthread_cond_destroy(&shards[i].fetched);
+	}
+	free(shards);
+	shards = NULL;
+	shard_total = 0;
+}
+
+ProxyCacheResult proxy_cache_lookup(const char *url, long *http_code, struct MemoryStruct *body, ProxyCacheMeta *meta) {
+	if (!shards) return PROXY_CACHE_BYPASS;
+
+	uint64_t hash = hash_url(url);
+	CacheShard *shard = shard_for(hash);
+	pthread_mutex_lock(&shard->lock);
+
+	// Callers are event loops, so a fetch that hangs is waited for only so long before fetching without the cache.
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FETCH_WAIT_MS / 1000;
+	deadline.tv_nsec += (FETCH_WAIT_MS % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	CacheEntry *entry = find_entry(shard, url, hash);
+	while (entry && entry->fetching) {
+		if (pthread_cond_timedwait(&shard->fetched, &shard->lock, &deadline) == ETIMEDOUT) {
+			entry = find_entry(shard, url, hash);
+			if (entry && entry->fetching) {
+				shard->misses++;
+				pthread_mutex_unlock(&shard->lock);
+				return PROXY_CACHE_BYPASS;
+			}
+			break;
+		}
+		entry = find_entry(shard, url, hash);
+	}
+
+	if (!entry) {
+		entry = calloc(1, sizeof(CacheEntry));
+		if (!entry || !(entry->url = strdup(url))) {
+			free(entry);
+			pthread_mutex_unlock(&shard->lock);
+			return PROXY_CACHE_BYPASS;
+		}
+		entry->hash = hash;
+		entry->chain = shard->buckets[hash % CACHE_BUCKETS_PER_SHARD];
+		shard->buckets[hash % CACHE_BUCKETS_PER_SHARD] = entry;
+		lru_push_front(shard, entry);
+		shard->entries++;
+		if (spill_directory[0]) {
+			// Read without the lock. Lookups of the same url wait on the placeholder meanwhile,
+			// and eviction and flushes skip it.
+			entry->fetching = 1;
+			pthread_mutex_unlock(&shard->lock);
+			unspill_entry(entry);
+			pthread_mutex_lock(&shard->lock);
+			entry->fetching = 0;
+			pthread_cond_broadcast(&shard->fetched);
+		}
+		shard->bytes += entry_cost(entry);
+	} else {
+		lru_unlink(shard, entry);
+		lru_push_front(shard, entry);
+	}
+
+	if (entry->valid && entry->fresh_until > time(NULL)) {
+		copy_response(entry, http_code, body, meta);
+		shard->hits++;
+		pthread_mutex_unlock(&shard->lock);
+		return PROXY_CACHE_HIT;
+	}
+
+	shard->misses++;
+	entry->fetching = 1;
+	memset(meta, 0, sizeof(*meta));
+	meta->max_age = -1;
+	ProxyCacheResult result = PROXY_CACHE_FETCH;
+	if (entry->valid && (entry->etag[0] || entry->last_modified[0])) {
+		memcpy(meta->etag, entry->etag, sizeof(meta->etag));
+		memcpy(meta->last_modified, entry->last_modified, sizeof(meta->last_modified));
+		result = PROXY_CACHE_REVALIDATE;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return result;
+}
+
+static void copy_header_value(char *dst, size_t size, const char *value, size_t len) {
+	while (len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n' || value[len - 1] == ' ')) len--;
+	if (len >= size) len = size - 1;
+	memcpy(dst, value, len);
+	dst[len] = '\0';
+}
+
+void proxy_cache_parse_header(ProxyCacheMeta *meta, const char *line, size_t len) {
+	const char *colon = memchr(line, ':', len);
+	if (!colon) return;
+
+	size_t name_len = colon - line;
+	const char *value = colon + 1;
+	size_t value_len = len - name_len - 1;
+	while (value_len > 0 && *value == ' ') {
+		value++;
+		value_len--;
+	}
+
+	char text[256];
+	copy_header_value(text, sizeof(text), value, value_len);
+
+	if (name_len == 4 && strncasecmp(line, "ETag", 4) == 0) {
+		copy_header_value(meta->etag, sizeof(meta->etag), value, value_len);
+	} else if (name_len == 13 && strncasecmp(line, "Last-Modified", 13) == 0) {
+		copy_header_value(meta->last_modified, sizeof(meta->last_modified), value, value_len);
+	} else if (name_len == 12 && strncasecmp(line, "Content-Type", 12) == 0) {
+		copy_header_value(meta->content_type, sizeof(meta->content_type), value, value_len);
+	} else if (name_len == 3 && strncasecmp(line, "Age", 3) == 0) {
+		meta->age = strtol(text, NULL, 10);
+	} else if (name_len == 7 && strncasecmp(line, "Expires", 7) == 0) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		// An unparseable Expires such as "0" means already expired.
+		meta->expires = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm) ? timegm(&tm) : 1;
+	} else if (name_len == 13 && strncasecmp(line, "Cache-Control", 13) == 0) {
+		char *save = NULL;
+		for (char *token = strtok_r(text, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+			while (*token == ' ') token++;
+			if (strncasecmp(token, "no-store", 8) == 0 || strncasecmp(token, "private", 7) == 0) {
+				meta->no_store = 1;
+			} else if (strncasecmp(token, "no-cache", 8) == 0) {
+				meta->no_cache = 1;
+			} else if (strncasecmp(token, "s-maxage=", 9) == 0) {
+				// Shared caches prefer s-maxage over max-age.
+				meta->max_age = strtol(token + 9, NULL, 10);
+				meta->expires = 0;
+			} else if (strncasecmp(token, "max-age=", 8) == 0 && meta->max_age < 0) {
+				meta->max_age = strtol(token + 8, NULL, 10);
+			}
+		}
+	}
+}
+
+// Returns the entries to hand to spill_evicted() once the lock is released.
+static CacheEntry *finish_fetch(CacheShard *shard, CacheEntry *entry) {
+	entry->fetching = 0;
+	if (!entry->valid) {
+		remove_entry(shard, entry);
+	}
+	pthread_cond_broadcast(&shard->fetched);
+	return evict_over_budget(shard);
+}
+
+void proxy_cache_store(const char *url, long http_code, const struct MemoryStruct *body, const ProxyCacheMeta *meta) {
+	if (!shards) return;
+
+	uint64_t hash = hash_url(url);
+	CacheShard *shard = shard_for(hash);
+	pthread_mutex_lock(&shard->lock);
+	CacheEntry *entry = find_entry(shard, url, hash);
+	if (!entry) {
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	time_t now = time(NULL);
+	time_t until = fresh_until(meta, http_code, now);
+	int storable = !meta->no_store && (until > now || meta->etag[0] || meta->last_modified[0])
+		&& (http_code < 500 || explicit_freshness(meta));
+	char *copy = storable ? malloc(body->size + 1) : NULL;
+
+	shard->bytes -= entry_cost(entry);
+	free(entry->body);
+	entry->body = NULL;
+	entry->size = 0;
+	entry->valid = 0;
+	if (copy) {
+		memcpy(copy, body->memory, body->size);
+		copy[body->size] = '\0';
+		entry->body = copy;
+		entry->size = body->size;
+		entry->http_code = http_code;
+		entry->fresh_until = until;
+		memcpy(entry->etag, meta->etag, sizeof(entry->etag));
+		memcpy(entry->last_modified, meta->last_modified, sizeof(entry->last_modified));
+		memcpy(entry->content_type, meta->content_type, sizeof(entry->content_type));
+		entry->valid = 1;
+	}
+	shard->bytes += entry_cost(entry);
+
+	CacheEntry *evicted = finish_fetch(shard, entry);
+	pthread_mutex_unlock(&shard->lock);
+	spill_evicted(evicted);
+}
+
+int proxy_cache_revalidated(const char *url, ProxyCacheMeta *meta, long *http_code, struct MemoryStruct *body) {
+	if (!shards) return -1;
+
+	uint64_t hash = hash_url(url);
+	CacheShard *shard = shard_for(hash);
+	pthread_mutex_lock(&shard->lock);
+	CacheEntry *entry = find_entry(shard, url, hash);
+	int result = -1;
+	if (entry && entry->valid) {
+		entry->fresh_until = fresh_until(meta, entry->http_code, time(NULL));
+		if (meta->etag[0]) memcpy(entry->etag, meta->etag, sizeof(entry->etag));
+		if (meta->last_modified[0]) memcpy(entry->last_modified, meta->last_modified, sizeof(entry->last_modified));
+		copy_response(entry, http_code, body, meta);
+		result = 0;
+	}
+	CacheEntry *evicted = entry ? finish_fetch(shard, entry) : NULL;
+	pthread_mutex_unlock(&shard->lock);
+	spill_evicted(evicted);
+	return result;
+}
+
+void proxy_cache_abandon(const char *url) {
+	if (!shards) return;
+
+	uint64_t hash = hash_url(url);
+	CacheShard *shard = shard_for(hash);
+	pthread_mutex_lock(&shard->lock);
+	CacheEntry *entry = find_entry(shard, url, hash);
+	CacheEntry *evicted = entry ? finish_fetch(shard, entry) : NULL;
+	pthread_mutex_unlock(&shard->lock);
+	spill_evicted(evicted);
+}
+
+int proxy_cache_stats(ProxyCacheStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (!shards) return -1;
+
+	stats->shards = shard_total;
+	for (int i = 0; i < shard_total; i++) {
+		CacheShard *shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		stats->entries += shard->entries;
+		stats->bytes += shard->bytes;
+		stats->budget += shard->budget;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		for (CacheEntry *entry = shard->lru_head; entry; entry = entry->next) {
+			if (entry->fetching) stats->fetching++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return 0;
+}
+
+size_t proxy_cache_flush() {
+	if (!shards) return 0;
+
+	size_t flushed = 0;
+	for (int i = 0; i < shard_total; i++) {
+		CacheShard *shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		CacheEntry *entry = shard->lru_head;
+		while (entry) {
+			CacheEntry *next = entry->next;
+			// Placeholders of running fetches are left for their owner to complete.
+			if (!entry->fetching) {
+				remove_entry(shard, entry);
+				flushed++;
+			}
+			entry = next;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	if (spill_directory[0]) {
+		DIR *dir = opendir(spill_directory);
+		if (dir) {
+			struct dirent *file;
+			while ((file = readdir(dir)) != NULL) {
+				size_t len = strlen(file->d_name);
+				if (len > 6 && strcmp(file->d_name + len - 6, ".cache") == 0) {
+					char path[512];
+					snprintf(path, sizeof(path), "%s/%s", spill_directory, file->d_name);
+					if (unlink(path) == 0) flushed++;
+				}
+			}
+			closedir(dir);
+		}
+	}
+	return flushed;
+}
@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/rate_limit.h"
+
+#define RL_PROBE_LIMIT 8
+#define RL_SHARDS 16
+
+typedef struct {
+	uint32_t addr;
+	int used;
+	uint64_t last_seen_ns;
+	double tokens[RL_KIND_COUNT];
+	uint64_t refill_ns[RL_KIND_COUNT];
+} RateBucket;
+
+typedef struct {
+	pthread_mutex_t lock;
+	RateBucket *buckets;
+} RateShard;
+
+struct RateLimiter {
+	RateLimitRule rules[RL_KIND_COUNT];
+	RateShard shards[RL_SHARDS];
+	size_t mask; // of the bucket table in each shard
+};
+
+static uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t hash_addr(uint32_t addr) {
+	uint32_t h = addr * 2654435761u;
+	return (size_t)(h ^ (h >> 16));
+}
+
+static void reset_bucket(RateLimiter *limiter, RateBucket *bucket, uint32_t addr, uint64_t now) {
+	bucket->addr = addr;
+	bucket->used = 1;
+	bucket->last_seen_ns = now;
+	for (int k = 0; k < RL_KIND_COUNT; k++) {
+		bucket->tokens[k] = limiter->rules[k].burst;
+		bucket->refill_ns[k] = now;
+	}
+}
+
+// Probes a short window and, if the address is not there, recycles the stalest slot.
+// A bucket that has been idle long enough is full again, so evicting it loses nothing.
+static RateBucket *find_bucket(RateLimiter *limiter, RateShard *shard, size_t hash, uint32_t addr, uint64_t now) {
+	size_t start = hash & limiter->mask;
+	RateBucket *victim = NULL;
+
+	for (size_t i = 0; i < RL_PROBE_LIMIT; i++) {
+		RateBucket *bucket = &shard->buckets[(start + i) & limiter->mask];
+		if (!bucket->used) {
+			reset_bucket(limiter, bucket, addr, now);
+			return bucket;
+		}
+		if (bucket->addr == addr) {
+			return bucket;
+		}
+		if (!victim || bucket->last_seen_ns < victim->last_seen_ns) {
+			victim = bucket;
+		}
+	}
+
+	reset_bucket(limiter, victim, addr, now);
+	return victim;
+}
+
+RateLimiter *rate_limiter_create(const RateLimitRule rules[RL_KIND_COUNT], size_t capacity) {
+	size_t size = RL_PROBE_LIMIT;
+	while (size * RL_SHARDS < capacity) size <<= 1;
+
+	RateLimiter *limiter = calloc(1, sizeof(RateLimiter));
+	if (!limiter) return NULL;
+
+	for (int i = 0; i < RL_SHARDS; i++) {
+		pthread_mutex_init(&limiter->shards[i].lock, NULL);
+		limiter->shards[i].buckets = calloc(size, sizeof(RateBucket));
+		if (!limiter->shards[i].buckets) {
+			rate_limiter_destroy(limiter);
+			return NULL;
+		}
+	}
+	memcpy(limiter->rules, rules, sizeof(limiter->rules));
+	limiter->mask = size - 1;
+	return limiter;
+}
+
+void rate_limiter_destroy(RateLimiter *limiter) {
+	if (!limiter) return;
+	for (int i = 0; i < RL_SHARDS; i++) {
+		pthread_mutex_destroy(&limiter->shards[i].lock);
+		free(limiter->shards[i].buckets);
+	}
+	free(limiter);
+}
+
+int rate_limiter_allow(RateLimiter *limiter, uint32_t addr, RateLimitKind kind, double cost) {
+	if (!limiter || limiter->rules[kind].rate <= 0) return 1;
+	if (cost < 0) cost = 0; // a negative cost would mint tokens
+
+	const RateLimitRule *rule = &limiter->rules[kind];
+	size_t hash = hash_addr(addr);
+	// The top bits pick the shard, the low bits the slot, so one address always maps to one bucket.
+	RateShard *shard = &limiter->shards[(hash >> 24) % RL_SHARDS];
+	pthread_mutex_lock(&shard->lock);
+	uint64_t now = monotonic_ns();
+	RateBucket *bucket = find_bucket(limiter, shard, hash, addr, now);
+	bucket->last_seen_ns = now;
+
+	double elapsed = (double)(now - bucket->refill_ns[kind]) / 1e9;
+	bucket->tokens[kind] += elapsed * rule->rate;
+	if (bucket->tokens[kind] > rule->burst) {
+		bucket->tokens[kind] = rule->burst;
+	}
+	bucket->refill_ns[kind] = now;
+
+	// A cost larger than the whole bucket is admitted once the bucket is full and paid back as debt,
+	// otherwise large uploads could never pass.
+	double needed = cost < rule->burst ? cost : rule->burst;
+	int allowed = bucket->tokens[kind] >= needed;
+	if (allowed) bucket->tokens[kind] -= cost;
+	pthread_mutex_unlock(&shard->lock);
+	return allowed;
+}
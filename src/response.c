@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../include/response.h"
+#include "../include/trace.h"
+
+#define SEND_WAIT_MS 30000
+
+typedef struct {
+	long code;
+	const char *reason;
+	const char *line;
+	size_t length;
+} StatusLine;
+
+#define STATUS_LINE(code, reason) { code, reason, "HTTP/1.1 " #code " " reason "\r\n", sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+static const StatusLine status_lines[] = {
+	STATUS_LINE(100, "Continue"),
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(201, "Created"),
+	STATUS_LINE(202, "Accepted"),
+	STATUS_LINE(204, "No Content"),
+	STATUS_LINE(301, "Moved Permanently"),
+	STATUS_LINE(302, "Found"),
+	STATUS_LINE(304, "Not Modified"),
+	STATUS_LINE(400, "Bad Request"),
+	STATUS_LINE(403, "Forbidden"),
+	STATUS_LINE(404, "Not Found"),
+	STATUS_LINE(405, "Method Not Allowed"),
+	STATUS_LINE(411, "Length Required"),
+	STATUS_LINE(429, "Too Many Requests"),
+	STATUS_LINE(500, "Internal Server Error"),
+	STATUS_LINE(501, "Not Implemented"),
+	STATUS_LINE(502, "Bad Gateway"),
+	STATUS_LINE(503, "Service Unavailable"),
+	STATUS_LINE(504, "Gateway Timeout"),
+};
+
+static const char SERVER_HEADER[] = "Server: web_server\r\n";
+static const char KEEP_ALIVE_HEADER[] = "Connection: keep-alive\r\n";
+static const char CLOSE_HEADER[] = "Connection: close\r\n";
+static const char CONTENT_LENGTH_NAME[] = "Content-Length: ";
+
+// Formatted at most once per second per thread.
+static __thread time_t date_second = 0;
+static __thread char date_header[48];
+static __thread size_t date_length = 0;
+
+static const StatusLine *find_status(long http_code) {
+	for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+		if (status_lines[i].code == http_code) return &status_lines[i];
+	}
+	return NULL;
+}
+
+const char *http_reason_phrase(long http_code) {
+	const StatusLine *status = find_status(http_code);
+	return status ? status->reason : "Unknown";
+}
+
+static void append(Response *response, const char *data, size_t len) {
+	if (response->length + len > sizeof(response->head)) {
+		response->overflow = 1;
+		return;
+	}
+	memcpy(response->head + response->length, data, len);
+	response->length += len;
+}
+
+static size_t format_decimal(char *out, unsigned long long value) {
+	char digits[20];
+	size_t count = 0;
+	do {
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	for (size_t i = 0; i < count; i++) {
+		out[i] = digits[count - 1 - i];
+	}
+	return count;
+}
+
+static void append_date(Response *response) {
+	time_t now = time(NULL);
+	if (now != date_second) {
+		struct tm tm;
+		gmtime_r(&now, &tm);
+		date_length = strftime(date_header, sizeof(date_header), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		date_second = now;
+	}
+	append(response, date_header, date_length);
+}
+
+void response_start(Response *response, long http_code) {
+	response->length = 0;
+	response->overflow = 0;
+
+	const StatusLine *status = find_status(http_code);
+	if (status) {
+		append(response, status->line, status->length);
+	} else {
+		char line[32];
+		size_t len = 0;
+		memcpy(line, "HTTP/1.1 ", 9);
+		len = 9 + format_decimal(line + 9, (unsigned long long)(http_code > 0 ? http_code : 500));
+		memcpy(line + len, " Unknown\r\n", 10);
+		append(response, line, len + 10);
+	}
+	append_date(response);
+	append(response, SERVER_HEADER, sizeof(SERVER_HEADER) - 1);
+}
+
+void response_header(Response *response, const char *name, const char *value) {
+	append(response, name, strlen(name));
+	append(response, ": ", 2);
+	append(response, value, strlen(value));
+	append(response, "\r\n", 2);
+}
+
+void response_content_length(Response *response, size_t length) {
+	char digits[24];
+	size_t len = format_decimal(digits, (unsigned long long)length);
+	append(response, CONTENT_LENGTH_NAME, sizeof(CONTENT_LENGTH_NAME) - 1);
+	append(response, digits, len);
+	append(response, "\r\n", 2);
+}
+
+void response_keep_alive(Response *response, int keep_alive) {
+	if (keep_alive) {
+		append(response, KEEP_ALIVE_HEADER, sizeof(KEEP_ALIVE_HEADER) - 1);
+	} else {
+		append(response, CLOSE_HEADER, sizeof(CLOSE_HEADER) - 1);
+	}
+}
+
+static int wait_writable(int client_socket) {
+	struct pollfd pfd = { client_socket, POLLOUT, 0 };
+	int ready;
+	do {
+		ready = poll(&pfd, 1, SEND_WAIT_MS);
+	} while (ready < 0 && errno == EINTR);
+	return ready > 0 ? 0 : -1;
+}
+
+static int sendmsg_all(int client_socket, struct iovec *iov, int iovcnt, int flags) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t sent = sendmsg(client_socket, &msg, MSG_NOSIGNAL | flags);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(client_socket) == 0) continue;
+			return -1;
+		}
+		while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+int writev_all(int client_socket, struct iovec *iov, int iovcnt) {
+	return sendmsg_all(client_socket, iov, iovcnt, 0);
+}
+
+static int finish_head(Response *response) {
+	append(response, "\r\n", 2);
+	return response->overflow ? -1 : 0;
+}
+
+int response_send(Response *response, int client_socket, const char *body, size_t body_len) {
+	if (finish_head(response) != 0) return -1;
+
+	struct iovec iov[2];
+	iov[0].iov_base = response->head;
+	iov[0].iov_len = response->length;
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = body_len;
+	trace_mark_once(TRACE_FIRST_BYTE_SENT);
+	return writev_all(client_socket, iov, body_len > 0 ? 2 : 1);
+}
+
+static int send_head_and_range(Response *response, int client_socket, int fd, off_t offset, off_t size) {
+	if (finish_head(response) != 0) return -1;
+	struct iovec iov = { response->head, response->length };
+	trace_mark_once(TRACE_FIRST_BYTE_SENT);
+	// MSG_MORE lets the kernel put the head into the first segment of the file data.
+	if (sendmsg_all(client_socket, &iov, 1, MSG_MORE) != 0) return -1;
+
+	off_t end = offset + size;
+	while (offset < end) {
+		ssize_t sent = sendfile(client_socket, fd, &offset, end - offset);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(client_socket) == 0) continue;
+			return -1;
+		}
+		if (sent == 0) return -1; // file shrank underneath us
+	}
+	return 0;
+}
+
+int response_send_file(Response *response, int client_socket, int fd, off_t size) {
+	if (size <= RESPONSE_SMALL_BODY_SIZE) {
+		char body[RESPONSE_SMALL_BODY_SIZE];
+		size_t filled = 0;
+		while (filled < (size_t)size) {
+			ssize_t got = pread(fd, body + filled, size - filled, filled);
+			if (got < 0 && errno == EINTR) continue;
+			if (got <= 0) return RESPONSE_NOT_SENT;
+			filled += got;
+		}
+		return response_send(response, client_socket, body, filled);
+	}
+
+	return send_head_and_range(response, client_socket, fd, 0, size);
+}
+
+int response_send_mapped(Response *response, int client_socket, const char *data, int fd, off_t offset, size_t size) {
+	if (size <= RESPONSE_SMALL_BODY_SIZE) {
+		return response_send(response, client_socket, data, size);
+	}
+	return send_head_and_range(response, client_socket, fd, offset, (off_t)size);
+}
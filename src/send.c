@@ -5,80 +5,127 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "../include/memory.h"
+#include "../include/send.h"
+#include "../include/response.h"
+#include "../include/trace.h"
+#include "../include/asset_bundle.h"
 
-#define BUFFER_SIZE 1024
 
-void send_html(int client_socket, const char *file_path) {
-	FILE *html_file = fopen(file_path, "r");
-	if (html_file == NULL) {
-		printf("Could not open file %s %d %s\n", file_path, errno, strerror(errno));
-		return;
-	}
+static const char FALLBACK_NOT_FOUND[] =
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Length: 13\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"404 Not Found";
+
+static const char RATE_LIMITED_KEEP_ALIVE[] =
+	"HTTP/1.1 429 Too Many Requests\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 17\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n"
+	"Too Many Requests";
+
+static const char RATE_LIMITED_CLOSE[] =
+	"HTTP/1.1 429 Too Many Requests\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 17\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"Too Many Requests";
+
+static const char UNAVAILABLE_KEEP_ALIVE[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 19\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n"
+	"Service Unavailable";
+
+static const char UNAVAILABLE_CLOSE[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 19\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"Service Unavailable";
+
+// Complete 503 responses around file/503.html, built once so shedding load costs a single send().
+static char *unavailable_page[2] = { NULL, NULL }; // [close_connection]
+static size_t unavailable_page_length[2] = { 0, 0 };
 
-	char buffer[BUFFER_SIZE];
-	size_t bytes_read;
-	fseek(html_file, 0, SEEK_END);
-	long content_length = ftell(html_file);
-	rewind(html_file);
-	char http_header[1024];
-	snprintf(http_header, sizeof(http_header),
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/html\r\n"
-		"Content-Length: %ld\r\n"
-		"Connection: keep-alive\r\n"
-		"\r\n", content_length);
-	send(client_socket, http_header, strlen(http_header), 0);
-
-	while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, html_file)) > 0) {
-		send(client_socket, buffer, bytes_read, 0);
-	}
-	fclose(html_file);
+void send_buffered_response(int client_socket, long http_code, const char *content_type, const char *body, size_t size) {
+	Response response;
+	response_start(&response, http_code);
+	response_header(&response, "Content-Type", content_type);
+	response_content_length(&response, size);
+	response_keep_alive(&response, 1);
+	response_send(&response, client_socket, body, size);
 }
 
-void send_error_html(int client_socket, const char *file_path, long http_code) {
-	FILE *html_file = fopen(file_path, "rb");
+static void send_internal_error(int client_socket) {
+	send_buffered_response(client_socket, 500, "text/plain", "Internal Server Error", 21);
+}
 
-	if (html_file == NULL) {
-		printf("ERROR: Could not open error file %s\n", file_path);
-		const char *fallback_msg = "HTTP/1.1 404 Not Found\r\nContent-Length: 13\r\nConnection: close\r\n\r\n404 Not Found";
-		send(client_socket, fallback_msg, strlen(fallback_msg), 0);
-		return;
+// Sends an HTML file with the given status, from the asset bundle when it holds the page.
+// Returns RESPONSE_NOT_SENT if the file cannot be read, -1 if the connection broke mid-response.
+static int send_html_file(int client_socket, const char *file_path, long http_code) {
+	const AssetEntry *asset = strncmp(file_path, "file/", 5) == 0 ? asset_bundle_lookup(file_path + 5) : NULL;
+	if (asset) {
+		return asset_bundle_send(client_socket, asset, http_code, NULL);
 	}
 
-	fseek(html_file, 0, SEEK_END);
-	long content_length = ftell(html_file);
-	rewind(html_file);
-
-	char header_buffer[1024];
-	const char *status_text = "500 Internal Server Error";
+	int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return RESPONSE_NOT_SENT;
+	}
 
-	switch (http_code) {
-		case 400: status_text = "400 Bad Request"; break;
-		case 403: status_text = "403 Forbidden"; break;
-		case 404: status_text = "404 Not Found"; break;
-		case 501: status_text = "501 Not Implemented"; break;
-		case 503: status_text = "503 Service Unavailable"; break;
-		case 201: status_text = "201 Created"; break;
-		case 204: status_text = "204 No Content"; break;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return RESPONSE_NOT_SENT;
 	}
 
-	snprintf(header_buffer, sizeof(header_buffer),
-"HTTP/1.1 %s\r\n"
-		"Content-Type: text/html\r\n"
-		"Content-Length: %ld\r\n"
-		"Connection: keep-alive\r\n"
-		"\r\n", status_text, content_length);
+	Response response;
+	response_start(&response, http_code);
+	response_header(&response, "Content-Type", "text/html");
+	response_content_length(&response, (size_t)st.st_size);
+	response_keep_alive(&response, 1);
+	int sent = response_send_file(&response, client_socket, fd, st.st_size);
+	close(fd);
+	return sent;
+}
 
-	send(client_socket, header_buffer, strlen(header_buffer), 0);
+int send_html(int client_socket, const char *file_path) {
+	int sent = send_html_file(client_socket, file_path, 200);
+	if (sent == RESPONSE_NOT_SENT) {
+		printf("Could not read file %s %d %s\n", file_path, errno, strerror(errno));
+		send_internal_error(client_socket);
+		return 0;
+	}
+	return sent;
+}
 
-	char buffer[BUFFER_SIZE];
-	size_t bytes_read;
-	while ((bytes_read = fread(buffer, 1, sizeof(buffer), html_file)) > 0) {
-		send(client_socket, buffer, bytes_read, 0);
+int send_error_html(int client_socket, const char *file_path, long http_code) {
+	int sent = send_html_file(client_socket, file_path, http_code);
+	if (sent == RESPONSE_NOT_SENT) {
+		printf("ERROR: Could not open error file %s\n", file_path);
+		send(client_socket, FALLBACK_NOT_FOUND, sizeof(FALLBACK_NOT_FOUND) - 1, MSG_NOSIGNAL);
+		trace_mark_once(TRACE_FIRST_BYTE_SENT);
+		return -1; // the fallback says Connection: close
 	}
+	return sent;
+}
 
-	fclose(html_file);
+int has_local_page(long http_code) {
+	switch (http_code) {
+		case 201: case 204: case 400: case 403: case 404: case 501: case 503:
+			return 1;
+	}
+	return 0;
 }
 
 void handle_client_response(int client_socket, long http_code, struct MemoryStruct *data) {
@@ -99,113 +146,164 @@ void handle_client_response(int client_socket, long http_code, struct MemoryStru
 	}
 }
 
-void handle_file_upload(int client_socket, char *path, char *buffer, size_t bytes_read) {
-	char file_path[512];
-	snprintf(file_path, sizeof(file_path), "%s", path + 1);
-	printf("Saving uploaded file to %s\n", file_path);
-
-	char *len_str = strstr(buffer, "Content-Length: ");
-	long content_length = 0;
-	if (len_str) {
-		content_length = strtol(len_str + 16, NULL, 10);
-	}
-	
-	if (content_length <= 0) {
-		char *msg = "HTTP/1.1 411 Length Required\r\n"
-					"Content-Length: 15\r\n"
-					"Connection: close\r\n\r\n"
-					"Length Required";
-		send(client_socket, msg, strlen(msg), 0);
-		return;
+static const char UPLOAD_CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+void upload_file_init(UploadFile *file, const char *path) {
+	file->fd = -1;
+	snprintf(file->file_path, sizeof(file->file_path), "%s", path + 1);
+	snprintf(file->part_path, sizeof(file->part_path), "%s.part", file->file_path);
+}
+
+int upload_file_write(UploadFile *file, const char *data, size_t len) {
+	if (file->fd < 0) {
+		file->fd = open(file->part_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (file->fd < 0) {
+			printf("Could not open %s %d %s\n", file->part_path, errno, strerror(errno));
+			return -1;
+		}
+		printf("Saving uploaded file to %s\n", file->file_path);
+	}
+	while (len > 0) {
+		ssize_t written = write(file->fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			printf("Could not write %s %d %s\n", file->part_path, errno, strerror(errno));
+			return -1;
+		}
+		data += written;
+		len -= (size_t)written;
 	}
+	return 0;
+}
 
-	char *body_start = strstr(buffer, "\r\n\r\n");
-	if (!body_start) {
-		printf("Error: Could not find end of headers\n");
-		return;
+int upload_file_commit(UploadFile *file) {
+	int saved = upload_file_write(file, NULL, 0) == 0 && fsync(file->fd) == 0;
+	if (file->fd >= 0) close(file->fd);
+	file->fd = -1;
+	if (!saved || rename(file->part_path, file->file_path) != 0) {
+		perror("File save error");
+		unlink(file->part_path);
+		return -1;
 	}
-	body_start += 4;
+	printf("File saved successfully.\n");
+	return 0;
+}
 
-	long header_len = body_start - buffer;
-	long bytes_in_buffer = bytes_read - header_len;
+void upload_file_discard(UploadFile *file) {
+	if (file->fd < 0) return;
+	close(file->fd);
+	file->fd = -1;
+	unlink(file->part_path);
+}
 
-	FILE *fp = fopen(file_path, "wb");
-	if (!fp) {
-		perror("File open error");
-		char *msg = "HTTP/1.1 500 Internal Server Error\r\n"
-					"Content-Length: 16\r\n"
-					"Connection: keep-alive\r\n\r\n"
-					"Cannot open file";
-		send(client_socket, msg, strlen(msg), 0);
+void send_upload_status(int client_socket, long http_code, int close_connection) {
+	trace_mark_once(TRACE_FIRST_BYTE_SENT);
+	if (http_code == 100) {
+		send(client_socket, UPLOAD_CONTINUE, sizeof(UPLOAD_CONTINUE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 		return;
 	}
 
-	if (bytes_in_buffer > 0) {
-		fwrite(body_start, 1, bytes_in_buffer, fp);
-		content_length -= bytes_in_buffer;
-	}
-
-	char data_buffer[BUFFER_SIZE];
-	ssize_t received;
-	while (content_length > 0) {
-		received = recv(client_socket, data_buffer, sizeof(data_buffer), 0);
-		if (received <= 0) break;
-		fwrite(data_buffer, 1, received, fp);
-		content_length -= received;
+	const char *body = "";
+	switch (http_code) {
+		case 400: body = "Bad Request"; break;
+		case 411: body = "Length Required"; break;
+		case 500: body = "Cannot save file"; break;
 	}
-
-	fclose(fp);
-
-	char *msg = "HTTP/1.1 201 Created\r\n"
-		"Content-Length: 0\r\n"
-		"Connection: keep-alive\r\n"
-		"\r\n";
-	send(client_socket, msg, strlen(msg), 0);
-	printf("File saved successfully.\n");
+	Response response;
+	response_start(&response, http_code);
+	response_content_length(&response, strlen(body));
+	response_keep_alive(&response, !close_connection);
+	response_send(&response, client_socket, body, strlen(body));
 }
 
-void handle_file_download(int client_socket, char *path) {
+int handle_file_download(int client_socket, char *path) {
 	char file_path[512];
 	snprintf(file_path, sizeof(file_path), ".%s", path);
 
-	FILE *fp = fopen(file_path, "rb");
-	if (!fp) {
+	int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
 		printf("File open error");
+		if (fd >= 0) close(fd);
 		char *msg = "HTTP/1.1 404 Not Found\r\n"
 					"Content-Length: 14\r\n"
 					"Connection: keep-alive\r\n"
 					"\r\n"
 					"File Not Found";
 		send(client_socket, msg, strlen(msg), 0);
-		return;
+		trace_mark_once(TRACE_FIRST_BYTE_SENT);
+		return 0;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	long file_size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-
 	const char *filename = strrchr(file_path, '/');
 	if (!filename) filename++; // skip slash
 	else filename = "downloaded_file";
 
-	char headers[1024];
-	snprintf(headers, sizeof(headers),
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: application/octet-stream\r\n"
-		"Content-Disposition: attachment; filename=\"%s\"\r\n"
-		"Content-Length: %ld\r\n"
-		"Connection: keep-alive\r\n"
-		"\r\n",
-		filename, file_size);
+	char disposition[320];
+	snprintf(disposition, sizeof(disposition), "attachment; filename=\"%s\"", filename);
 
-	send(client_socket, headers, strlen(headers), 0);
+	Response response;
+	response_start(&response, 200);
+	response_header(&response, "Content-Type", "application/octet-stream");
+	response_header(&response, "Content-Disposition", disposition);
+	response_content_length(&response, (size_t)st.st_size);
+	response_keep_alive(&response, 1);
+	int sent = response_send_file(&response, client_socket, fd, st.st_size);
+	close(fd);
+	if (sent == RESPONSE_NOT_SENT) {
+		printf("Could not read %s %d %s\n", file_path, errno, strerror(errno));
+		send_internal_error(client_socket);
+		return 0;
+	}
+	if (sent != 0) return -1;
+	printf("File %s sent to client for download.\n", filename);
+	return 0;
+}
 
-	char buffer[4096];
-	size_t bytes_read;
-	while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-		send(client_socket, buffer, bytes_read, 0);
+void send_rate_limited(int client_socket, int close_connection) {
+	trace_mark_once(TRACE_FIRST_BYTE_SENT);
+	if (close_connection) {
+		send(client_socket, RATE_LIMITED_CLOSE, sizeof(RATE_LIMITED_CLOSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+		send(client_socket, RATE_LIMITED_KEEP_ALIVE, sizeof(RATE_LIMITED_KEEP_ALIVE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 	}
+}
 
+int prepare_unavailable_page(const char *file_path) {
+	FILE *fp = fopen(file_path, "rb");
+	if (!fp) return -1;
+	char body[4096];
+	size_t body_len = fread(body, 1, sizeof(body), fp);
 	fclose(fp);
-	printf("File %s sent to client for download.\n", filename);
+
+	for (int close_connection = 0; close_connection < 2; close_connection++) {
+		char head[256];
+		int head_len = snprintf(head, sizeof(head),
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Type: text/html\r\n"
+			"Retry-After: 1\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n"
+			"\r\n", body_len, close_connection ? "close" : "keep-alive");
+		char *page = malloc(head_len + body_len);
+		if (!page) return -1;
+		memcpy(page, head, head_len);
+		memcpy(page + head_len, body, body_len);
+		free(unavailable_page[close_connection]);
+		unavailable_page[close_connection] = page;
+		unavailable_page_length[close_connection] = head_len + body_len;
+	}
+	return 0;
+}
+
+void send_service_unavailable(int client_socket, int close_connection) {
+	trace_mark_once(TRACE_FIRST_BYTE_SENT);
+	int index = close_connection ? 1 : 0;
+	if (unavailable_page[index]) {
+		send(client_socket, unavailable_page[index], unavailable_page_length[index], MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else if (close_connection) {
+		send(client_socket, UNAVAILABLE_CLOSE, sizeof(UNAVAILABLE_CLOSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+		send(client_socket, UNAVAILABLE_KEEP_ALIVE, sizeof(UNAVAILABLE_KEEP_ALIVE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
 }
\ No newline at end of file
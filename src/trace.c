@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/trace.h"
+
+struct TraceRing {
+	TraceRecord *records;
+	size_t capacity;
+	size_t count;
+	size_t next;
+	uint64_t seq;
+	unsigned sample_every;
+	uint64_t slow_ns;
+};
+
+static __thread TraceRing *current_ring = NULL;
+static __thread TraceRecord *current_record = NULL;
+
+static const char *phase_names[TRACE_PHASE_COUNT] = {
+	"accepted", "wakeup", "first_byte", "headers_parsed", "handler_start",
+	"upstream_connect", "upstream_ttfb", "first_byte_sent", "last_byte_sent"
+};
+
+// Spans exported per request, each from one phase to the next one that was recorded.
+static const struct {
+	const char *name;
+	TracePhase from;
+	TracePhase to;
+} spans[] = {
+	{ "wait", TRACE_ACCEPTED, TRACE_WAKEUP },
+	{ "recv", TRACE_WAKEUP, TRACE_FIRST_BYTE },
+	{ "parse", TRACE_FIRST_BYTE, TRACE_HEADERS_PARSED },
+	{ "dispatch", TRACE_HEADERS_PARSED, TRACE_HANDLER_START },
+	{ "upstream_connect", TRACE_HANDLER_START, TRACE_UPSTREAM_CONNECT },
+	{ "upstream_ttfb", TRACE_UPSTREAM_CONNECT, TRACE_UPSTREAM_TTFB },
+	{ "handler", TRACE_HANDLER_START, TRACE_FIRST_BYTE_SENT },
+	{ "send", TRACE_FIRST_BYTE_SENT, TRACE_LAST_BYTE_SENT },
+};
+
+uint64_t trace_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+TraceRing *trace_ring_create(size_t capacity, unsigned sample_every, unsigned slow_ms) {
+	if (capacity == 0 || (sample_every == 0 && slow_ms == 0)) return NULL;
+
+	TraceRing *ring = calloc(1, sizeof(TraceRing));
+	if (!ring) return NULL;
+
+	ring->records = calloc(capacity, sizeof(TraceRecord));
+	if (!ring->records) {
+		free(ring);
+		return NULL;
+	}
+	ring->capacity = capacity;
+	ring->sample_every = sample_every;
+	ring->slow_ns = (uint64_t)slow_ms * 1000000ULL;
+	return ring;
+}
+
+void trace_ring_destroy(TraceRing *ring) {
+	if (!ring) return;
+	free(ring->records);
+	free(ring);
+}
+
+void trace_begin(TraceRing *ring, TraceRecord *record, int fd, uint64_t accepted_ns, uint64_t wakeup_ns) {
+	if (!ring) {
+		current_ring = NULL;
+		current_record = NULL;
+		return;
+	}
+
+	memset(record->ts, 0, sizeof(record->ts));
+	record->fd = fd;
+	record->method[0] = '\0';
+	record->path[0] = '\0';
+	record->ts[TRACE_ACCEPTED] = accepted_ns;
+	record->ts[TRACE_WAKEUP] = wakeup_ns;
+	current_ring = ring;
+	current_record = record;
+}
+
+// Copies a request token, replacing anything that would need escaping in the JSON output.
+static void copy_token(char *dst, size_t size, const char *src) {
+	size_t i = 0;
+	for (; src[i] && i < size - 1; i++) {
+		unsigned char c = (unsigned char)src[i];
+		dst[i] = (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') ? '_' : (char)c;
+	}
+	dst[i] = '\0';
+}
+
+void trace_set_request(const char *method, const char *path) {
+	if (!current_record) return;
+	copy_token(current_record->method, sizeof(current_record->method), method);
+	copy_token(current_record->path, sizeof(current_record->path), path);
+}
+
+void trace_mark(TracePhase phase) {
+	if (!current_record) return;
+	current_record->ts[phase] = trace_now_ns();
+}
+
+void trace_mark_once(TracePhase phase) {
+	if (!current_record || current_record->ts[phase]) return;
+	current_record->ts[phase] = trace_now_ns();
+}
+
+void trace_mark_at(TracePhase phase, uint64_t ns) {
+	if (!current_record) return;
+	current_record->ts[phase] = ns;
+}
+
+void trace_end() {
+	TraceRing *ring = current_ring;
+	TraceRecord *record = current_record;
+	current_ring = NULL;
+	current_record = NULL;
+	trace_commit(ring, record);
+}
+
+TraceRecord *trace_current() {
+	return current_record;
+}
+
+void trace_suspend() {
+	current_ring = NULL;
+	current_record = NULL;
+}
+
+void trace_resume(TraceRecord *record) {
+	current_ring = NULL;
+	current_record = record;
+}
+
+void trace_commit(TraceRing *ring, TraceRecord *record) {
+	if (!ring || !record) return;
+
+	ring->seq++;
+	int sampled = ring->sample_every && ring->seq % ring->sample_every == 0;
+	uint64_t start = record->ts[TRACE_FIRST_BYTE] ? record->ts[TRACE_FIRST_BYTE] : record->ts[TRACE_WAKEUP];
+	uint64_t end = record->ts[TRACE_LAST_BYTE_SENT];
+	int slow = ring->slow_ns && end > start && end - start >= ring->slow_ns;
+	if (!sampled && !slow) return;
+
+	ring->records[ring->next] = *record;
+	ring->next = (ring->next + 1) % ring->capacity;
+	if (ring->count < ring->capacity) ring->count++;
+}
+
+int trace_ring_dump(const TraceRing *ring, const char *file_path, int worker_id) {
+	if (!ring) return -1;
+
+	FILE *fp = fopen(file_path, "w");
+	if (!fp) return -1;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	int first = 1;
+	size_t oldest = (ring->next + ring->capacity - ring->count) % ring->capacity;
+	for (size_t n = 0; n < ring->count; n++) {
+		const TraceRecord *r = &ring->records[(oldest + n) % ring->capacity];
+		uint64_t start = r->ts[TRACE_WAKEUP];
+		uint64_t end = r->ts[TRACE_LAST_BYTE_SENT];
+		if (!start || end < start) continue;
+
+		fprintf(fp, "%s\n{\"name\":\"%s %s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+			first ? "" : ",", r->method, r->path, worker_id, r->fd, start / 1000.0, (end - start) / 1000.0);
+		first = 0;
+		// Phase offsets are relative to the wakeup, negative for the accept of a kept-alive connection.
+		for (int p = 0; p < TRACE_PHASE_COUNT; p++) {
+			fprintf(fp, "%s\"%s\":%.3f", p ? "," : "", phase_names[p],
+				r->ts[p] ? ((double)r->ts[p] - (double)start) / 1000.0 : -1.0);
+		}
+		fprintf(fp, "}}");
+
+		for (size_t s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+			uint64_t from = r->ts[spans[s].from];
+			uint64_t to = r->ts[spans[s].to];
+			if (!from || !to || to < from) continue;
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				spans[s].name, worker_id, r->fd, from / 1000.0, (to - from) / 1000.0);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	return 0;
+}
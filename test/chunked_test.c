@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/chunked.h"
+
+// Feeds chunked bodies to the decoder in every split the loop can see and checks what comes out.
+// Run with `make check`; exits non-zero when a case fails.
+
+#define OUTPUT_SIZE 256
+
+typedef struct {
+	char data[OUTPUT_SIZE];
+	size_t length;
+	size_t refuse_after; // the sink fails once this many bytes were written, 0 never
+} Output;
+
+static int failures = 0;
+
+static int collect(void *ctx, const char *data, size_t len) {
+	Output *out = ctx;
+	if (out->refuse_after && out->length + len > out->refuse_after) return -1;
+	if (out->length + len > sizeof(out->data)) return -1;
+	memcpy(out->data + out->length, data, len);
+	out->length += len;
+	return 0;
+}
+
+// Decodes input in pieces of step bytes, stopping like the upload path does once the body is complete.
+// Returns the number of input bytes consumed, or -1 on error.
+static long decode_in_steps(const char *input, size_t len, size_t step, Output *out, int *done) {
+	ChunkedDecoder decoder;
+	chunked_decoder_init(&decoder);
+	memset(out->data, 0, sizeof(out->data));
+	out->length = 0;
+	size_t offset = 0;
+	while (offset < len && !chunked_decoder_done(&decoder)) {
+		size_t piece = len - offset < step ? len - offset : step;
+		ssize_t consumed = chunked_decode(&decoder, input + offset, piece, collect, out);
+		if (consumed < 0) return -1;
+		offset += (size_t)consumed;
+		if ((size_t)consumed < piece) break;
+	}
+	*done = chunked_decoder_done(&decoder);
+	return (long)offset;
+}
+
+static void check(int ok, const char *name, size_t step, const char *what) {
+	if (!ok) {
+		printf("FAIL %s (step %zu): %s\n", name, step, what);
+		failures++;
+	}
+}
+
+// Every step size from one byte per call up to the whole input at once.
+static void expect_body(const char *name, const char *input, const char *body, size_t trailing) {
+	size_t len = strlen(input);
+	for (size_t step = 1; step <= len; step++) {
+		Output out = { .refuse_after = 0 };
+		int done = 0;
+		long consumed = decode_in_steps(input, len, step, &out, &done);
+		check(consumed >= 0, name, step, "decoder reported an error");
+		check(done, name, step, "body not complete");
+		check(consumed == (long)(len - trailing), name, step, "wrong number of bytes consumed");
+		check(out.length == strlen(body) && memcmp(out.data, body, out.length) == 0, name, step, "wrong body");
+	}
+}
+
+static void expect_error(const char *name, const char *input) {
+	size_t len = strlen(input);
+	for (size_t step = 1; step <= len; step++) {
+		Output out = { .refuse_after = 0 };
+		int done = 0;
+		check(decode_in_steps(input, len, step, &out, &done) == -1, name, step, "malformed input accepted");
+	}
+}
+
+static void expect_incomplete(const char *name, const char *input) {
+	size_t len = strlen(input);
+	for (size_t step = 1; step <= len; step++) {
+		Output out = { .refuse_after = 0 };
+		int done = 1;
+		long consumed = decode_in_steps(input, len, step, &out, &done);
+		check(consumed == (long)len && !done, name, step, "truncated body reported complete or failed");
+	}
+}
+
+int main() {
+	expect_body("empty body", "0\r\n\r\n", "", 0);
+	expect_body("two chunks", "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world", 0);
+	expect_body("hex digits in both cases", "a\r\n0123456789\r\nA\r\nabcdefghij\r\n0\r\n\r\n", "0123456789abcdefghij", 0);
+	expect_body("chunk extensions", "5;name=value\r\nhello\r\n3 ; x\r\nabc\r\n0;last\r\n\r\n", "helloabc", 0);
+	expect_body("trailer fields", "5\r\nhello\r\n0\r\nX-Checksum: 1234\r\nX-Other: a\r\n\r\n", "hello", 0);
+	expect_body("fifteen size digits", "000000000000005\r\nhello\r\n0\r\n\r\n", "hello", 0);
+	expect_body("pipelined request after the body", "5\r\nhello\r\n0\r\n\r\nGET / HTTP/1.1\r\n\r\n", "hello", 18);
+	expect_body("data containing CRLF", "4\r\n\r\n\r\n\r\n0\r\n\r\n", "\r\n\r\n", 0);
+
+	expect_error("sixteen size digits", "0000000000000005\r\nhello\r\n0\r\n\r\n");
+	expect_error("missing size", "\r\nhello\r\n0\r\n\r\n");
+	expect_error("non-hex size", "zz\r\nhello\r\n0\r\n\r\n");
+	expect_error("extension before any digit", ";x\r\n");
+	expect_error("size line without CR", "5\nhello\r\n0\r\n\r\n");
+	expect_error("data longer than its size", "5\r\nhelloX\r\n0\r\n\r\n");
+	expect_error("data without LF", "5\r\nhello\rX0\r\n\r\n");
+	expect_error("trailer line without LF", "0\r\nX: 1\rX\r\n");
+
+	expect_incomplete("truncated data", "a\r\nhello");
+	expect_incomplete("no terminating chunk", "5\r\nhello\r\n");
+	expect_incomplete("no blank line after the last chunk", "5\r\nhello\r\n0\r\n");
+
+	// A sink that refuses the data (write error, quota exceeded) fails the decode.
+	const char *body = "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+	for (size_t step = 1; step <= strlen(body); step++) {
+		Output out = { .refuse_after = 7 };
+		int done = 0;
+		check(decode_in_steps(body, strlen(body), step, &out, &done) == -1 && !done,
+			"sink refusal", step, "refused data did not fail the decode");
+	}
+
+	// Once complete the decoder takes nothing more, so leftover bytes stay with the caller.
+	ChunkedDecoder decoder;
+	chunked_decoder_init(&decoder);
+	Output out = { .refuse_after = 0 };
+	check(chunked_decode(&decoder, "0\r\n\r\n", 5, collect, &out) == 5, "after done", 5, "terminator not consumed");
+	check(chunked_decode(&decoder, "GET", 3, collect, &out) == 0, "after done", 3, "bytes consumed after the body");
+
+	// And once failed it keeps failing.
+	chunked_decoder_init(&decoder);
+	check(chunked_decode(&decoder, "x", 1, collect, &out) == -1, "after error", 1, "error not reported");
+	check(chunked_decode(&decoder, "5\r\n", 3, collect, &out) == -1, "after error", 3, "decoder recovered from an error");
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("chunked decoder: all checks passed\n");
+	return 0;
+}
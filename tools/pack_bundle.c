@@ -0,0 +1,331 @@
+// Packs a directory of static assets into the image served by the asset_bundle option.
+// usage: pack_bundle <asset dir> <bundle file>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "../include/asset_bundle.h"
+
+#define MAX_DISPLACEMENT (1u << 24)
+#define DATA_ALIGN 8
+
+typedef struct {
+	char *path;          // relative to the asset dir, the lookup key
+	unsigned char *body;
+	size_t body_length;
+	unsigned char *gzip;
+	size_t gzip_length;
+	uint32_t bucket;
+} Asset;
+
+typedef struct {
+	Asset *items;
+	size_t count;
+	size_t capacity;
+} AssetList;
+
+static const struct {
+	const char *extension;
+	const char *content_type;
+} CONTENT_TYPES[] = {
+	{ ".html", "text/html" },
+	{ ".htm", "text/html" },
+	{ ".css", "text/css" },
+	{ ".js", "application/javascript" },
+	{ ".json", "application/json" },
+	{ ".txt", "text/plain" },
+	{ ".xml", "application/xml" },
+	{ ".svg", "image/svg+xml" },
+	{ ".png", "image/png" },
+	{ ".jpg", "image/jpeg" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".gif", "image/gif" },
+	{ ".ico", "image/x-icon" },
+	{ ".webp", "image/webp" },
+	{ ".woff", "font/woff" },
+	{ ".woff2", "font/woff2" },
+	{ ".wasm", "application/wasm" },
+	{ ".pdf", "application/pdf" },
+};
+
+static const char *content_type_for(const char *path) {
+	const char *dot = strrchr(path, '.');
+	if (dot) {
+		for (size_t i = 0; i < sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]); i++) {
+			if (strcasecmp(dot, CONTENT_TYPES[i].extension) == 0) return CONTENT_TYPES[i].content_type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+static unsigned char *read_file(const char *path, size_t *length) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return NULL;
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+	unsigned char *data = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+	if (data && fread(data, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	*length = (size_t)st.st_size;
+	return data;
+}
+
+// Keeps a gzip variant only when it saves at least a tenth of the bytes.
+static void compress_asset(Asset *asset) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return;
+
+	size_t bound = deflateBound(&stream, asset->body_length);
+	unsigned char *out = malloc(bound);
+	if (out) {
+		stream.next_in = asset->body;
+		stream.avail_in = (uInt)asset->body_length;
+		stream.next_out = out;
+		stream.avail_out = (uInt)bound;
+		if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < asset->body_length - asset->body_length / 10) {
+			asset->gzip = out;
+			asset->gzip_length = stream.total_out;
+			out = NULL;
+		}
+		free(out);
+	}
+	deflateEnd(&stream);
+}
+
+static int collect(const char *root, const char *relative, AssetList *list) {
+	char dir_path[1024];
+	snprintf(dir_path, sizeof(dir_path), "%s%s%s", root, relative[0] ? "/" : "", relative);
+	DIR *dir = opendir(dir_path);
+	if (!dir) {
+		fprintf(stderr, "Cannot open %s: %s\n", dir_path, strerror(errno));
+		return -1;
+	}
+
+	struct dirent *item;
+	int result = 0;
+	while (result == 0 && (item = readdir(dir)) != NULL) {
+		if (item->d_name[0] == '.') continue;
+		char child[1024], full[2048];
+		snprintf(child, sizeof(child), "%s%s%s", relative, relative[0] ? "/" : "", item->d_name);
+		snprintf(full, sizeof(full), "%s/%s", root, child);
+
+		struct stat st;
+		if (stat(full, &st) != 0) continue;
+		if (S_ISDIR(st.st_mode)) {
+			result = collect(root, child, list);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) continue;
+
+		if (list->count == list->capacity) {
+			list->capacity = list->capacity ? list->capacity * 2 : 64;
+			list->items = realloc(list->items, list->capacity * sizeof(Asset));
+			if (!list->items) return -1;
+		}
+		Asset *asset = &list->items[list->count];
+		memset(asset, 0, sizeof(*asset));
+		asset->path = strdup(child);
+		asset->body = read_file(full, &asset->body_length);
+		if (!asset->path || !asset->body) {
+			fprintf(stderr, "Cannot read %s: %s\n", full, strerror(errno));
+			result = -1;
+			break;
+		}
+		compress_asset(asset);
+		list->count++;
+	}
+	closedir(dir);
+	return result;
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(((const Asset *)a)->path, ((const Asset *)b)->path);
+}
+
+static const uint32_t *sort_sizes = NULL;
+
+static int compare_bucket_size(const void *a, const void *b) {
+	uint32_t size_a = sort_sizes[*(const uint32_t *)a], size_b = sort_sizes[*(const uint32_t *)b];
+	return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+// Hash and displace: the largest buckets pick a displacement first, while most slots are still free.
+static int build_index(Asset *assets, uint32_t count, uint32_t bucket_count, uint32_t *displacements, uint32_t *slot_of) {
+	uint32_t *bucket_sizes = calloc(bucket_count, sizeof(uint32_t));
+	uint32_t *bucket_start = calloc(bucket_count + 1, sizeof(uint32_t));
+	uint32_t *order = malloc(bucket_count * sizeof(uint32_t));
+	uint32_t *members = malloc(count * sizeof(uint32_t));
+	unsigned char *taken = calloc(count, 1);
+	uint32_t *slots = malloc(count * sizeof(uint32_t));
+	int result = -1;
+	if (!bucket_sizes || !bucket_start || !order || !members || !taken || !slots) goto done;
+
+	for (uint32_t i = 0; i < count; i++) {
+		assets[i].bucket = (uint32_t)(asset_bundle_hash(assets[i].path, strlen(assets[i].path), 0) % bucket_count);
+		bucket_sizes[assets[i].bucket]++;
+	}
+	for (uint32_t b = 0; b < bucket_count; b++) {
+		bucket_start[b + 1] = bucket_start[b] + bucket_sizes[b];
+		order[b] = b;
+	}
+	uint32_t *next = calloc(bucket_count, sizeof(uint32_t));
+	if (!next) goto done;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t b = assets[i].bucket;
+		members[bucket_start[b] + next[b]++] = i;
+	}
+	free(next);
+	sort_sizes = bucket_sizes;
+	qsort(order, bucket_count, sizeof(uint32_t), compare_bucket_size);
+
+	for (uint32_t i = 0; i < bucket_count; i++) {
+		uint32_t bucket = order[i];
+		uint32_t size = bucket_sizes[bucket];
+		if (size == 0) break;
+		const uint32_t *bucket_members = &members[bucket_start[bucket]];
+
+		uint32_t d;
+		for (d = 1; d < MAX_DISPLACEMENT; d++) {
+			uint32_t placed = 0;
+			for (; placed < size; placed++) {
+				const char *path = assets[bucket_members[placed]].path;
+				uint32_t slot = (uint32_t)(asset_bundle_hash(path, strlen(path), d) % count);
+				uint32_t k = 0;
+				while (k < placed && slots[k] != slot) k++;
+				if (taken[slot] || k < placed) break;
+				slots[placed] = slot;
+			}
+			if (placed == size) break;
+		}
+		if (d == MAX_DISPLACEMENT) goto done;
+
+		displacements[bucket] = d;
+		for (uint32_t k = 0; k < size; k++) {
+			taken[slots[k]] = 1;
+			slot_of[bucket_members[k]] = slots[k];
+		}
+	}
+	result = 0;
+
+done:
+	free(bucket_sizes);
+	free(bucket_start);
+	free(order);
+	free(members);
+	free(taken);
+	free(slots);
+	return result;
+}
+
+static uint64_t align_up(uint64_t value) {
+	return (value + DATA_ALIGN - 1) & ~(uint64_t)(DATA_ALIGN - 1);
+}
+
+static uint64_t hash_body(const unsigned char *data, size_t length) {
+	return asset_bundle_hash((const char *)data, length, 0);
+}
+
+static int write_at(FILE *fp, uint64_t offset, const void *data, size_t length) {
+	if (fseek(fp, (long)offset, SEEK_SET) != 0) return -1;
+	return fwrite(data, 1, length, fp) == length ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <asset dir> <bundle file>\n", argv[0]);
+		return 1;
+	}
+
+	AssetList list = { NULL, 0, 0 };
+	if (collect(argv[1], "", &list) != 0) return 1;
+	if (list.count == 0) {
+		fprintf(stderr, "No assets found in %s\n", argv[1]);
+		return 1;
+	}
+	qsort(list.items, list.count, sizeof(Asset), compare_paths);
+
+	uint32_t count = (uint32_t)list.count;
+	uint32_t bucket_count = (count + 1) / 2;
+	uint32_t *displacements = calloc(bucket_count, sizeof(uint32_t));
+	uint32_t *slot_of = calloc(count, sizeof(uint32_t));
+	AssetEntry *entries = calloc(count, sizeof(AssetEntry));
+	if (!displacements || !slot_of || !entries) return 1;
+	if (build_index(list.items, count, bucket_count, displacements, slot_of) != 0) {
+		fprintf(stderr, "Could not build the path index\n");
+		return 1;
+	}
+
+	AssetBundleHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ASSET_BUNDLE_MAGIC, 8);
+	header.version = ASSET_BUNDLE_VERSION;
+	header.entry_count = count;
+	header.bucket_count = bucket_count;
+	header.displacements_offset = align_up(sizeof(header));
+	header.entries_offset = align_up(header.displacements_offset + bucket_count * sizeof(uint32_t));
+
+	FILE *fp = fopen(argv[2], "wb");
+	if (!fp) {
+		fprintf(stderr, "Cannot create %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+
+	uint64_t offset = header.entries_offset + (uint64_t)count * sizeof(AssetEntry);
+	size_t compressed = 0;
+	int failed = 0;
+	for (uint32_t i = 0; i < count && !failed; i++) {
+		Asset *asset = &list.items[i];
+		AssetEntry *entry = &entries[slot_of[i]];
+		uint64_t digest = hash_body(asset->body, asset->body_length);
+		snprintf(entry->content_type, sizeof(entry->content_type), "%s", content_type_for(asset->path));
+		snprintf(entry->etag, sizeof(entry->etag), "\"%016llx\"", (unsigned long long)digest);
+		snprintf(entry->gzip_etag, sizeof(entry->gzip_etag), "\"%016llx-gz\"", (unsigned long long)digest);
+
+		entry->path_offset = offset;
+		entry->path_length = (uint32_t)strlen(asset->path);
+		failed |= write_at(fp, offset, asset->path, entry->path_length);
+		offset = align_up(offset + entry->path_length);
+
+		entry->body_offset = offset;
+		entry->body_length = asset->body_length;
+		failed |= write_at(fp, offset, asset->body, asset->body_length);
+		offset = align_up(offset + asset->body_length);
+
+		if (asset->gzip) {
+			entry->gzip_offset = offset;
+			entry->gzip_length = asset->gzip_length;
+			failed |= write_at(fp, offset, asset->gzip, asset->gzip_length);
+			offset = align_up(offset + asset->gzip_length);
+			compressed++;
+		}
+	}
+
+	header.file_size = offset;
+	failed |= write_at(fp, 0, &header, sizeof(header));
+	failed |= write_at(fp, header.displacements_offset, displacements, bucket_count * sizeof(uint32_t));
+	failed |= write_at(fp, header.entries_offset, entries, count * sizeof(AssetEntry));
+	// Padding after the last asset is never written by the loop, extend the file to the recorded size.
+	failed |= fflush(fp) != 0 || ftruncate(fileno(fp), (off_t)offset) != 0;
+	failed |= fclose(fp) != 0;
+	if (failed) {
+		fprintf(stderr, "Writing %s failed: %s\n", argv[2], strerror(errno));
+		remove(argv[2]);
+		return 1;
+	}
+
+	printf("Packed %u assets (%zu with gzip variants) into %s, %llu bytes\n",
+		count, compressed, argv[2], (unsigned long long)offset);
+	return 0;
+}